@@ -50,6 +50,14 @@ bool FindPermutationInBlob(
     size_t* pSize
 );
 
+bool FindPermutationInBlobByIndex(
+    const void* blob,
+    size_t blobSize,
+    uint32_t index,
+    const void** pBinary,
+    size_t* pSize
+);
+
 void EnumeratePermutationsInBlob(
     const void* blob,
     size_t blobSize,
@@ -95,6 +95,46 @@ bool FindPermutationInBlob(const void* blob, size_t blobSize, const ShaderConsta
     return false; // went through the blob, permutation not found
 }
 
+bool FindPermutationInBlobByIndex(const void* blob, size_t blobSize, uint32_t index, const void** pBinary, size_t* pSize)
+{
+    if (!blob || blobSize < g_BlobSignatureSize)
+        return false;
+
+    if (!pBinary || !pSize)
+        return false;
+
+    if (memcmp(blob, g_BlobSignature, g_BlobSignatureSize) != 0)
+        return false;
+
+    blob = static_cast<const char*>(blob) + g_BlobSignatureSize;
+    blobSize -= g_BlobSignatureSize;
+
+    for (uint32_t n = 0; blobSize > sizeof(ShaderBlobEntry); n++)
+    {
+        const ShaderBlobEntry* header = static_cast<const ShaderBlobEntry*>(blob);
+
+        if (header->dataSize == 0)
+            return false; // last header in the blob is empty
+
+        if (blobSize < sizeof(ShaderBlobEntry) + header->dataSize + header->permutationSize)
+            return false; // insufficient bytes in the blob, cannot continue
+
+        if (n == index)
+        {
+            *pBinary = static_cast<const char*>(blob) + sizeof(ShaderBlobEntry) + header->permutationSize;
+            *pSize = header->dataSize;
+
+            return true;
+        }
+
+        size_t offset = sizeof(ShaderBlobEntry) + header->dataSize + header->permutationSize;
+        blob = static_cast<const char*>(blob) + offset;
+        blobSize -= offset;
+    }
+
+    return false; // went through the blob, index is out of range
+}
+
 void EnumeratePermutationsInBlob(const void* blob, size_t blobSize, std::vector<std::string>& permutations)
 {
     if (!blob || blobSize < g_BlobSignatureSize)
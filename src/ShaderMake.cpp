@@ -26,13 +26,20 @@ THE SOFTWARE.
 #include <sstream>
 #include <fstream>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <list>
-#include <regex>
+#include <deque>
+#include <memory>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <filesystem>
 #include <atomic>
+#include <algorithm>
+#include <tuple>
 #include <cstdio>
 #include <csignal>
 #include <cstdarg>
@@ -48,6 +55,23 @@ THE SOFTWARE.
 #else
     #include <unistd.h>
     #include <limits.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <dirent.h>
+    #include <poll.h>
+    #include <spawn.h>
+    #include <sys/wait.h>
+    #include <sys/resource.h>
+
+    #ifdef __linux__
+        #include <sched.h>
+        #include <sys/inotify.h>
+        #include <sys/epoll.h>
+        #include <sys/syscall.h>
+    #endif
+
+    extern char** environ;
 #endif
 
 using namespace std;
@@ -61,6 +85,8 @@ namespace fs = filesystem;
 #define USE_GLOBAL_OPTIMIZATION_LEVEL 0xFF
 #define SPIRV_SPACES_NUM 8
 #define PDB_DIR "PDB"
+#define STATE_DIR ".ShaderMake"
+#define KILL_GRACE_PERIOD 2000.0 // ms between SIGTERM and SIGKILL
 
 #ifdef _MSC_VER
     #define popen _popen
@@ -93,20 +119,31 @@ struct Options
     const char* compiler = nullptr;
     const char* outputExt = nullptr;
     const char* vulkanMemoryLayout = nullptr;
+    const char* registry = nullptr;
+    const char* depfile = nullptr;
+    const char* depfileTarget = nullptr;
     uint32_t sRegShift = 100; // must be first (or change "DxcCompile" code)
     uint32_t tRegShift = 200;
     uint32_t bRegShift = 300;
     uint32_t uRegShift = 400;
     uint32_t optimizationLevel = 3;
+    uint32_t registryDataFiles = 1;
     Platform platform = DXBC;
     bool serial = false;
     bool flatten = false;
     bool force = false;
+    bool contentHash = false;
+    bool compilerDeps = false;
+    bool explain = false;
+    bool watch = false;
+    bool impact = false;
     bool help = false;
     bool binary = false;
     bool header = false;
     bool binaryBlob = false;
     bool headerBlob = false;
+    bool assembly = false;
+    bool typedPermutations = false;
     bool continueOnError = false;
     bool warningsAreErrors = false;
     bool allResourcesBound = false;
@@ -122,6 +159,9 @@ struct Options
     bool slangHlsl = false;
     bool noRegShifts = false;
     int retryCount = 10; // default 10 retries for compilation task sub-process failures
+    int jobs = 0; // 0 - available CPUs
+    int memoryBudget = 0; // MB, 0 - unlimited
+    int taskTimeout = 0; // s, 0 - unlimited
 
     bool Parse(int32_t argc, const char** argv);
 
@@ -151,25 +191,104 @@ struct TaskData
     string profile;
     string outputFileWithoutExt;
     string combinedDefines;
+    vector<string> dependencies; // reported by the compiler, empty if unknown
+    uint64_t hash = 0; // of the include closure and effective options, 0 if unknown
+    uint64_t optionsHash = 0;
+    uint64_t memoryEstimate = 0; // peak memory of the compiler process, used by "--memoryBudget"
     uint32_t optimizationLevel = 3;
 };
 
+struct Permutation
+{
+    TaskData taskData;
+    fs::path sourceFile;
+    string blobName;
+    fs::file_time_type outputTime;
+    string reason; // why it's rebuilt, reported by "--explain"
+    string reasonDetail;
+    uint32_t macroSetIndex = 0;
+    bool force = false;
+};
+
 struct BlobEntry
 {
     string permutationFileWithoutExt;
     string combinedDefines;
+    uint32_t previousIndex = UINT32_MAX; // index in the previous blob, if the permutation is taken from there
+};
+
+struct RegistryEntry
+{
+    string shaderName;
+    string combinedDefines;
+    string permutationFileWithoutExt;
+};
+
+// What an output was last successfully built from
+struct ManifestEntry
+{
+    vector<string> dependencies; // reported by the compiler
+    uint64_t hash = 0;
+    uint64_t optionsHash = 0;
+};
+
+// How long a task took to compile
+struct TaskHistoryEntry
+{
+    uint64_t sourceKey = 0;
+    float duration = 0.0f; // ms
+    float memory = 0.0f; // peak memory of the compiler process in MB, 0 if unknown
+};
+
+struct ScannedInclude
+{
+    string name;
+    string condition; // preprocessor expression, under which the include is active (empty if always)
+};
+
+// Includes and macros of a file and its content hash, valid as long as the file time and size don't change
+struct DependencyCacheEntry
+{
+    vector<ScannedInclude> includes;
+    vector<string> macros; // defined or undefined in the file
+    int64_t time = 0;
+    uint64_t size = 0;
+    uint64_t hash = 0;
+    bool isUsed = false; // looked up since loaded, unused entries are not saved
+};
+
+struct ShaderPermutations
+{
+    fs::path headerFile;
+    vector<vector<string>> defines; // in blob order
 };
 
 Options g_Options;
-map<fs::path, fs::file_time_type> g_HierarchicalUpdateTimes;
+unordered_map<string, fs::file_time_type> g_HierarchicalUpdateTimes; // key = "macroSetIndex|file"
 map<string, vector<BlobEntry>> g_ShaderBlobs;
+map<string, vector<uint8_t>> g_PreviousBlobs;
+vector<RegistryEntry> g_RegistryEntries;
+map<string, ShaderPermutations> g_ShaderPermutations;
+unordered_map<string, ManifestEntry> g_Manifest; // key = "outputFileWithoutExt"
+set<string> g_OutputFiles;
+vector<Permutation> g_Permutations;
 vector<TaskData> g_TaskData;
 mutex g_TaskMutex;
+mutex g_ManifestMutex;
+bool g_IsManifestDirty = false;
+unordered_map<uint64_t, TaskHistoryEntry> g_TaskHistory; // key = "GetTaskKey"
+mutex g_TaskHistoryMutex;
+bool g_IsTaskHistoryDirty = false;
+unordered_map<string, DependencyCacheEntry> g_DependencyCache; // key = file
+mutex g_DependencyCacheMutex;
+bool g_IsDependencyCacheDirty = false;
 atomic<uint32_t> g_ProcessedTaskCount;
 atomic<int> g_TaskRetryCount;
 atomic<bool> g_Terminate = false;
+atomic<bool> g_IsInterrupted = false;
 atomic<uint32_t> g_FailedTaskCount = 0;
 uint32_t g_OriginalTaskCount;
+const char* g_ThreadsNumOrigin = "";
 const char* g_OutputExt = nullptr;
 
 static const char* g_PlatformNames[] = {
@@ -220,6 +339,42 @@ Naming convention:
 inline uint32_t HashToUint(size_t hash)
 { return uint32_t(hash) ^ (uint32_t(hash >> 32)); }
 
+// Fast non-cryptographic 64-bit hash, only used to detect changes
+uint64_t Hash(const void* data, size_t size, uint64_t seed = 0)
+{
+    auto mix = [](uint64_t x)
+    {
+        x ^= x >> 31;
+        x *= 0xBF58476D1CE4E5B9ull;
+        x ^= x >> 29;
+
+        return x;
+    };
+
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ull);
+
+    for (; size >= 8; bytes += 8, size -= 8)
+    {
+        uint64_t x;
+        memcpy(&x, bytes, 8);
+        h ^= mix(x);
+        h = ((h << 27) | (h >> 37)) * 0x9E3779B97F4A7C15ull + 0x94D049BB133111EBull;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, bytes, size);
+    h ^= mix(tail ^ size);
+
+    return mix(h * 0x94D049BB133111EBull);
+}
+
+inline uint64_t Hash(const string& s, uint64_t seed = 0)
+{ return Hash(s.data(), s.size(), seed); }
+
+inline uint64_t Hash(uint64_t value, uint64_t seed = 0)
+{ return Hash(&value, sizeof(value), seed); }
+
 inline string PathToString(fs::path path)
 { return path.lexically_normal().make_preferred().string(); }
 
@@ -245,6 +400,23 @@ inline fs::path RemoveLeadingDotDots(const fs::path& path)
 inline bool IsSpace(char ch)
 { return strchr(" \t\r\n", ch) != nullptr; }
 
+inline bool IsIdentifierChar(char ch)
+{ return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_'; }
+
+inline bool IsIdentifier(const char* s)
+{
+    if (!*s || (*s >= '0' && *s <= '9'))
+        return false;
+
+    for (; *s; s++)
+    {
+        if (!IsIdentifierChar(*s))
+            return false;
+    }
+
+    return true;
+}
+
 inline bool HasRepeatingSpace(char a, char b)
 { return (a == b) && a == ' '; }
 
@@ -256,6 +428,20 @@ inline string EscapePath(const string& s)
     return s;
 }
 
+inline string EscapeString(const string& s)
+{
+    string result;
+    result.reserve(s.size());
+    for (char ch : s)
+    {
+        if (ch == '"' || ch == '\\')
+            result += '\\';
+        result += ch;
+    }
+
+    return result;
+}
+
 inline void TrimConfigLine(string& s)
 {
     // Remove leading whitespace
@@ -302,6 +488,86 @@ void TokenizeConfigLine(char* in, vector<const char*>& tokens)
         tokens.push_back(token);
 }
 
+// Parses a string with command line options into a vector of strings, one string per option.
+// Options are separated by spaces and may be quoted with "double quotes".
+// Backslash (\) followed by a double quote or a space inserts that character literally into the output, otherwise
+// it's an ordinary character, so Windows paths don't need escaping.
+template<typename T>
+void TokenizeCompilerOptions(const char* in, vector<T>& out)
+{
+    T current;
+    bool quotes = false;
+    const char* ptr = in;
+    while (char ch = *ptr++)
+    {
+        if (ch == '\\' && (*ptr == '"' || *ptr == ' '))
+        {
+            current.push_back(typename T::value_type(*ptr++));
+            continue;
+        }
+
+        if (ch == ' ' && !quotes)
+        {
+            if (!current.empty())
+                out.push_back(current);
+            current.clear();
+        }
+        else if (ch == '"')
+        {
+            quotes = !quotes;
+        }
+        else
+        {
+            current.push_back(typename T::value_type(ch));
+        }
+    }
+
+    if (!current.empty())
+        out.push_back(current);
+}
+
+// Resolves a bare executable name through "PATH" the way the compiler gets started ("posix_spawnp" or the shell)
+fs::path FindExecutable(const char* name)
+{
+    fs::path file = name;
+    if (file.has_parent_path())
+        return file;
+
+#ifdef _WIN32
+    const char separator = ';';
+    const bool hasExtension = file.has_extension();
+
+    // The shell looks in the current directory first
+    string dirs = string(".;") + (getenv("PATH") ? getenv("PATH") : "");
+#else
+    const char separator = ':';
+    const bool hasExtension = true;
+
+    string dirs = getenv("PATH") ? getenv("PATH") : "/bin:/usr/bin";
+#endif
+
+    for (size_t begin = 0; begin <= dirs.size();)
+    {
+        size_t end = dirs.find(separator, begin);
+        if (end == string::npos)
+            end = dirs.size();
+
+        // An empty entry is the current directory
+        fs::path dir = dirs.substr(begin, end - begin);
+        fs::path candidate = dir.empty() ? file : dir / file;
+        begin = end + 1;
+
+        error_code ec;
+        if (fs::is_regular_file(candidate, ec))
+            return candidate;
+
+        if (!hasExtension && fs::is_regular_file(candidate += ".exe", ec))
+            return candidate;
+    }
+
+    return file;
+}
+
 uint32_t GetFileLength(FILE* stream)
 {
     /*
@@ -420,7 +686,10 @@ public:
     }
 
     void WriteTextPreamble(const char* shaderName)
-    { fprintf(stream, "const uint8_t %s[] = {", shaderName); }
+    {
+        fprintf(stream, "const uint8_t %s[] = {", shaderName);
+        m_lineLength = 129;
+    }
 
     void WriteTextEpilog()
     { fprintf(stream, "\n};\n"); }
@@ -444,34 +713,146 @@ private:
     uint32_t m_lineLength = 129;
 };
 
-void DumpShader(const TaskData& taskData, const uint8_t* data, size_t dataSize)
+// Writes "file.S", which embeds the binary "file" via ".incbin", and "file.S.h" with the matching declarations.
+// The symbol names are the same as in the header files, so the C++ compiler never needs to parse the data.
+// The binary is referenced relative to "file.S", so the output directory can be moved or cached.
+bool WriteAssembly(const string& file, const string& shaderName)
+{
+    string incbinPath = fs::path(file).filename().generic_string();
+    for (size_t pos = 0; (pos = incbinPath.find('"', pos)) != string::npos; pos += 2)
+        incbinPath.insert(pos, "\\");
+
+    {
+        DataOutputContext context((file + ".S").c_str(), true);
+        if (!context.stream)
+            return false;
+
+        fprintf(context.stream,
+            "/* Generated by ShaderMake, do not edit */\n"
+            "\n"
+            "#if defined(__APPLE__)\n"
+            "    #define SHADERMAKE_SYMBOL(name) _##name\n"
+            "    .section __TEXT,__const\n"
+            "#elif defined(_WIN32)\n"
+            "    #define SHADERMAKE_SYMBOL(name) name\n"
+            "    .section .rdata,\"dr\"\n"
+            "#else\n"
+            "    #define SHADERMAKE_SYMBOL(name) name\n"
+            "    .section .rodata\n"
+            "#endif\n"
+            "\n"
+            "    .globl SHADERMAKE_SYMBOL(%s)\n"
+            "    .balign 16\n"
+            "SHADERMAKE_SYMBOL(%s):\n"
+            "    .incbin \"%s\"\n"
+            "1:\n"
+            "\n"
+            "    .globl SHADERMAKE_SYMBOL(%s_size)\n"
+            "    .balign 4\n"
+            "SHADERMAKE_SYMBOL(%s_size):\n"
+            "    .long 1b - SHADERMAKE_SYMBOL(%s)\n"
+            "\n"
+            "#if defined(__ELF__)\n"
+            "    .type SHADERMAKE_SYMBOL(%s), %%object\n"
+            "    .size SHADERMAKE_SYMBOL(%s), 1b - SHADERMAKE_SYMBOL(%s)\n"
+            "    .type SHADERMAKE_SYMBOL(%s_size), %%object\n"
+            "    .size SHADERMAKE_SYMBOL(%s_size), 4\n"
+            "    .section .note.GNU-stack,\"\",%%progbits\n"
+            "#endif\n",
+            shaderName.c_str(), shaderName.c_str(), incbinPath.c_str(),
+            shaderName.c_str(), shaderName.c_str(), shaderName.c_str(),
+            shaderName.c_str(), shaderName.c_str(), shaderName.c_str(),
+            shaderName.c_str(), shaderName.c_str());
+    }
+
+    {
+        DataOutputContext context((file + ".S.h").c_str(), true);
+        if (!context.stream)
+            return false;
+
+        fprintf(context.stream,
+            "// Generated by ShaderMake, do not edit\n"
+            "#pragma once\n"
+            "\n"
+            "#include <stdint.h>\n"
+            "\n"
+            "#ifdef __cplusplus\n"
+            "extern \"C\" {\n"
+            "#endif\n"
+            "\n"
+            "extern const uint8_t %s[];\n"
+            "extern const uint32_t %s_size;\n"
+            "\n"
+            "#ifdef __cplusplus\n"
+            "}\n"
+            "#endif\n",
+            shaderName.c_str(), shaderName.c_str());
+    }
+
+    return true;
+}
+
+inline bool IsBinaryOutput(const TaskData& taskData)
+{ return g_Options.binary || (g_Options.binaryBlob && taskData.combinedDefines.empty()); }
+
+bool DumpShader(const TaskData& taskData, const uint8_t* data, size_t dataSize)
 {
     string file = taskData.outputFileWithoutExt + g_OutputExt;
 
     if (g_Options.binary || g_Options.binaryBlob || (g_Options.headerBlob && !taskData.combinedDefines.empty()))
     {
-        DataOutputContext context(file.c_str(), false);
-        if (!context.stream)
-            return;
+        {
+            DataOutputContext context(file.c_str(), false);
+            if (!context.stream)
+                return false;
 
-        context.WriteDataAsBinary(data, dataSize);
+            context.WriteDataAsBinary(data, dataSize);
+        }
+
+        if (g_Options.assembly && IsBinaryOutput(taskData))
+        {
+            if (!WriteAssembly(file, GetShaderName(taskData.outputFileWithoutExt)))
+                return false;
+        }
     }
 
     if (g_Options.header || (g_Options.headerBlob && taskData.combinedDefines.empty()))
     {
         DataOutputContext context((file + ".h").c_str(), true);
         if (!context.stream)
-            return;
+            return false;
 
         string shaderName = GetShaderName(taskData.outputFileWithoutExt);
         context.WriteTextPreamble(shaderName.c_str());
         context.WriteDataAsText(data, dataSize);
         context.WriteTextEpilog();
     }
+
+    return true;
+}
+
+void UpdateManifest(const TaskData& taskData, bool isSucceeded)
+{
+    lock_guard<mutex> guard(g_ManifestMutex);
+
+    if (isSucceeded && taskData.hash)
+    {
+        ManifestEntry& entry = g_Manifest[taskData.outputFileWithoutExt];
+        entry.dependencies = taskData.dependencies;
+        entry.hash = taskData.hash;
+        entry.optionsHash = taskData.optionsHash;
+    }
+    else
+        g_Manifest.erase(taskData.outputFileWithoutExt);
+
+    g_IsManifestDirty = true;
 }
 
 void UpdateProgress(const TaskData& taskData, bool isSucceeded, bool willRetry, const char* message)
 {
+    if (!willRetry)
+        UpdateManifest(taskData, isSucceeded);
+
     // IMPORTANT: do not split into several "Printf" calls because multi-threading access to the console can mess up the order
     if (isSucceeded)
     {
@@ -497,17 +878,15 @@ void UpdateProgress(const TaskData& taskData, bool isSucceeded, bool willRetry,
     }
     else
     {
-        // If retrying, requeue the task and try again without counting failure or terminating
+        // If retrying, the caller requeues the task. The message tells why, e.g. a timeout
         if (willRetry)
         {
-            Printf(YELLOW "[ RETRY-QUEUED ] %s %s {%s} {%s}\n",
+            Printf(YELLOW "[ RETRY-QUEUED ] %s %s {%s} {%s}\n%s",
                 g_Options.platformName,
                 taskData.source.c_str(),
                 taskData.entryPoint.c_str(),
-                taskData.combinedDefines.c_str());
-
-            lock_guard<mutex> guard(g_TaskMutex);
-            g_TaskData.push_back(taskData);
+                taskData.combinedDefines.c_str(),
+                message ? message : "");
 
             --g_TaskRetryCount;
         }
@@ -528,6 +907,126 @@ void UpdateProgress(const TaskData& taskData, bool isSucceeded, bool willRetry,
     }
 }
 
+// Parses Makefile rules "target: dependency1 dependency2 \\ ..." written by a compiler
+bool ReadDepfile(const string& file, vector<string>& outDependencies)
+{
+    ifstream stream(file, ios::binary);
+    if (!stream)
+        return false;
+
+    string text((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+
+    bool isTarget = true;
+    string token;
+
+    auto flush = [&]()
+    {
+        if (!token.empty() && !isTarget)
+            outDependencies.push_back(PathToString(fs::absolute(token)));
+
+        token.clear();
+    };
+
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        char c = text[i];
+        char next = i + 1 < text.size() ? text[i + 1] : '\n';
+
+        if (c == '\\' && (next == '\n' || next == '\r')) // line continuation
+        {
+            flush();
+            i++;
+
+            if (next == '\r' && i + 1 < text.size() && text[i + 1] == '\n')
+                i++;
+        }
+        else if (c == '\\' && (next == ' ' || next == '#')) // escaped character, other backslashes are Windows paths
+        {
+            token += next;
+            i++;
+        }
+        else if (c == '$' && next == '$')
+        {
+            token += '$';
+            i++;
+        }
+        else if (c == ':' && isTarget && isspace((uint8_t)next)) // not a drive letter
+        {
+            token.clear();
+            isTarget = false;
+        }
+        else if (isspace((uint8_t)c))
+        {
+            flush();
+
+            if (c == '\n')
+                isTarget = true;
+        }
+        else
+            token += c;
+    }
+
+    flush();
+
+    return !outDependencies.empty();
+}
+
+// Hashes paths and contents of dependencies the same way "IsUpToDateByCompilerDependencies" does. Contents are not
+// read again, content hashes are taken from the dependency cache, which is filled before compilation. Fails if a
+// dependency is not in the cache or has been modified since "startTime", because then it's unknown which version of
+// the file the compiler has read
+bool GetCompilerDependenciesHash(const vector<string>& dependencies, fs::file_time_type startTime, uint64_t& outHash)
+{
+    outHash = 0;
+    for (const string& dependency : dependencies)
+    {
+        error_code ec;
+        fs::file_time_type time = fs::last_write_time(dependency, ec);
+        uint64_t size = ec ? 0 : (uint64_t)fs::file_size(dependency, ec);
+        if (ec || time >= startTime)
+            return false;
+
+        lock_guard<mutex> guard(g_DependencyCacheMutex);
+
+        auto found = g_DependencyCache.find(dependency);
+        if (found == g_DependencyCache.end() || found->second.time != (int64_t)time.time_since_epoch().count() || found->second.size != size)
+            return false;
+
+        outHash = Hash(found->second.hash, Hash(dependency, outHash));
+    }
+
+    return true;
+}
+
+// Replaces the scanned include tree of a task with the files the compiler has actually read, except relaxed includes.
+// "startTime" is taken before the compiler starts
+void SetCompilerDependencies(TaskData& taskData, vector<string> dependencies, fs::file_time_type startTime)
+{
+    auto isRelaxed = [](const string& dependency)
+    {
+        for (const fs::path& relaxedInclude : g_Options.relaxedIncludes)
+        {
+            string name = "/" + relaxedInclude.generic_string();
+            string file = fs::path(dependency).generic_string();
+            if (file.size() >= name.size() && file.compare(file.size() - name.size(), name.size(), name) == 0)
+                return true;
+        }
+
+        return false;
+    };
+
+    dependencies.erase(remove_if(dependencies.begin(), dependencies.end(), isRelaxed), dependencies.end());
+
+    // A dependency modified during compilation doesn't get a hash, i.e. the next run recompiles the task
+    uint64_t dependenciesHash;
+    if (GetCompilerDependenciesHash(dependencies, startTime, dependenciesHash))
+        taskData.hash = Hash(dependenciesHash, taskData.optionsHash);
+    else
+        taskData.hash = 0;
+
+    taskData.dependencies = move(dependencies);
+}
+
 //=====================================================================================================================
 // TIMER
 //=====================================================================================================================
@@ -565,1568 +1064,5840 @@ uint64_t Timer_GetTicks()
 }
 
 //=====================================================================================================================
-// OPTIONS
+// TASK SCHEDULER
 //=====================================================================================================================
 
-int AddInclude(struct argparse* self, const struct argparse_option* option)
-{ ((Options*)(option->data))->includeDirs.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+// Per-worker deques of indices into "g_TaskData". A worker takes tasks from the back of its own deque and steals from
+// the front of others, so workers rarely contend for the same lock and tasks are never copied
+class TaskScheduler
+{
+public:
+    // Tasks at the end of "g_TaskData" go first
+    void Init(uint32_t taskNum, uint32_t workerNum)
+    {
+        m_queues = make_unique<Queue[]>(workerNum);
+        m_queueNum = workerNum;
 
-int AddGlobalDefine(struct argparse* self, const struct argparse_option* option)
-{ ((Options*)(option->data))->defines.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+        for (uint32_t i = 0; i < taskNum; i++)
+            m_queues[i % workerNum].tasks.push_back(i);
+    }
 
-int AddRelaxedInclude(struct argparse* self, const struct argparse_option* option)
-{ ((Options*)(option->data))->relaxedIncludes.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+    bool Pop(uint32_t workerIndex, uint32_t& outTaskIndex)
+    {
+        {
+            Queue& queue = m_queues[workerIndex];
+            lock_guard<mutex> guard(queue.lock);
 
-int AddSpirvExtension(struct argparse* self, const struct argparse_option* option)
-{ ((Options*)(option->data))->spirvExtensions.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+            if (!queue.tasks.empty())
+            {
+                outTaskIndex = queue.tasks.back();
+                queue.tasks.pop_back();
 
-int AddCompilerOptions(struct argparse* self, const struct argparse_option* option)
-{ ((Options*)(option->data))->compilerOptions.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+                return true;
+            }
+        }
 
-bool Options::Parse(int32_t argc, const char** argv)
+        for (uint32_t i = 1; i < m_queueNum; i++)
+        {
+            Queue& victim = m_queues[(workerIndex + i) % m_queueNum];
+            lock_guard<mutex> guard(victim.lock);
+
+            if (!victim.tasks.empty())
+            {
+                outTaskIndex = victim.tasks.front();
+                victim.tasks.pop_front();
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Push(uint32_t workerIndex, uint32_t taskIndex)
+    {
+        Queue& queue = m_queues[workerIndex];
+        lock_guard<mutex> guard(queue.lock);
+
+        queue.tasks.push_back(taskIndex);
+    }
+
+private:
+    struct Queue
+    {
+        mutex lock;
+        deque<uint32_t> tasks;
+    };
+
+    unique_ptr<Queue[]> m_queues;
+    uint32_t m_queueNum = 0;
+};
+
+TaskScheduler g_TaskScheduler;
+
+// Identifies a task across runs, regardless of options
+uint64_t GetTaskKey(const TaskData& taskData)
 {
-    const char* config = nullptr;
-    const char* unused = nullptr; // storage for callbacks
+    uint64_t hash = Hash(taskData.source);
+    hash = Hash(taskData.entryPoint, hash);
+    hash = Hash(taskData.profile, hash);
+    hash = Hash(taskData.combinedDefines, hash);
 
-    struct argparse_option options[] = {
-        OPT_HELP(),
-        OPT_GROUP("Required options:"),
-            OPT_STRING('p', "platform", &platformName, "DXBC, DXIL or SPIRV", nullptr, 0, 0),
-            OPT_STRING('c', "config", &config, "Configuration file with the list of shaders to compile", nullptr, 0, 0),
-            OPT_STRING('o', "out", &outputDir, "Output directory", nullptr, 0, 0),
-            OPT_BOOLEAN('b', "binary", &binary, "Output binary files", nullptr, 0, 0),
-            OPT_BOOLEAN('h', "header", &header, "Output header files", nullptr, 0, 0),
-            OPT_BOOLEAN('B', "binaryBlob", &binaryBlob, "Output binary blob files", nullptr, 0, 0),
-            OPT_BOOLEAN('H', "headerBlob", &headerBlob, "Output header blob files", nullptr, 0, 0),
-            OPT_STRING(0, "compiler", &compiler, "Path to a FXC/DXC/Slang compiler executable", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "slang", &slang, "Compiler is Slang", nullptr, 0, 0),
-        OPT_GROUP("Compiler settings:"),
-            OPT_STRING('m', "shaderModel", &shaderModel, "Shader model for DXIL/SPIRV (always SM 5.0 for DXBC)", nullptr, 0, 0),
-            OPT_INTEGER('O', "optimization", &optimizationLevel, "Optimization level 0-3 (default = 3, disabled = 0)", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "WX", &warningsAreErrors, "Maps to '-WX' DXC/FXC option: warnings are errors", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "allResourcesBound", &allResourcesBound, "Maps to '-all_resources_bound' DXC/FXC option: all resources bound", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "PDB", &pdb, "Output PDB files in 'out/PDB/' folder", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "embedPDB", &embedPdb, "Embed PDB with the shader binary", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "stripReflection", &stripReflection, "Maps to '-Qstrip_reflect' DXC/FXC option: strip reflection information from a shader binary", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "matrixRowMajor", &matrixRowMajor, "Maps to '-Zpr' DXC/FXC option: pack matrices in row-major order", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "hlsl2021", &hlsl2021, "Maps to '-HV 2021' DXC option: enable HLSL 2021 standard", nullptr, 0, 0),
-            OPT_STRING(0, "vulkanMemoryLayout", &vulkanMemoryLayout, "Maps to '-fvk-use-<VALUE>-layout' DXC options: dx, gl, scalar", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "slangHLSL", &slangHlsl, "Use HLSL compatibility mode when compiler is Slang", nullptr, 0, 0),
-            OPT_STRING('X', "compilerOptions", &unused, "Custom command line options for the compiler, separated by spaces", AddCompilerOptions, (intptr_t)this, 0),
-        OPT_GROUP("Defines & include directories:"),
-            OPT_STRING('I', "include", &unused, "Include directory(s)", AddInclude, (intptr_t)this, 0),
-            OPT_STRING('D', "define", &unused, "Macro definition(s) in forms 'M=value' or 'M'", AddGlobalDefine, (intptr_t)this, 0),
-        OPT_GROUP("Other options:"),
-            OPT_BOOLEAN('f', "force", &force, "Treat all source files as modified", nullptr, 0, 0),
-            OPT_STRING(0, "sourceDir", &sourceDir, "Source code directory", nullptr, 0, 0),
-            OPT_STRING(0, "relaxedInclude", &unused, "Include file(s) not invoking re-compilation", AddRelaxedInclude, (intptr_t)this, 0),
-            OPT_STRING(0, "outputExt", &outputExt, "Extension for output files, default is one of .dxbc, .dxil, .spirv", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "serial", &serial, "Disable multi-threading", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "flatten", &flatten, "Flatten source directory structure in the output directory", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "continue", &continueOnError, "Continue compilation if an error is occured", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "useAPI", &useAPI, "Use FXC (d3dcompiler) or DXC (dxcompiler) API explicitly (Windows only)", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "colorize", &colorize, "Colorize console output", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "verbose", &verbose, "Print commands before they are executed", nullptr, 0, 0),
-            OPT_INTEGER(0, "retryCount", &retryCount, "Retry count for compilation task sub-process failures", nullptr, 0, 0),
-        OPT_GROUP("SPIRV options:"),
-            OPT_STRING(0, "vulkanVersion", &vulkanVersion, "Vulkan environment version, maps to '-fspv-target-env' (default = 1.3)", nullptr, 0, 0),
-            OPT_STRING(0, "spirvExt", &unused, "Maps to '-fspv-extension' option: add SPIR-V extension permitted to use", AddSpirvExtension, (intptr_t)this, 0),
-            OPT_INTEGER(0, "sRegShift", &sRegShift, "SPIRV: register shift for sampler (s#) resources", nullptr, 0, 0),
-            OPT_INTEGER(0, "tRegShift", &tRegShift, "SPIRV: register shift for texture (t#) resources", nullptr, 0, 0),
-            OPT_INTEGER(0, "bRegShift", &bRegShift, "SPIRV: register shift for constant (b#) resources", nullptr, 0, 0),
-            OPT_INTEGER(0, "uRegShift", &uRegShift, "SPIRV: register shift for UAV (u#) resources", nullptr, 0, 0),
-            OPT_BOOLEAN(0, "noRegShifts", &noRegShifts, "Don't specify any register shifts for the compiler", nullptr, 0, 0),
-        OPT_END(),
-    };
+    return hash;
+}
 
-    static const char* usages[] = {
-        "ShaderMake.exe -p {DXBC|DXIL|SPIRV} --binary [--header --blob] -c \"path/to/config\"\n"
-        "\t-o \"path/to/output\" --compiler \"path/to/compiler\" [other options]\n"
-        "\t-D DEF1 -D DEF2=1 ... -I \"path1\" -I \"path2\" ...",
-        nullptr
-    };
+void UpdateTaskHistory(const TaskData& taskData, uint64_t ticks, uint64_t peakMemory)
+{
+    float duration = (float)Timer_ConvertTicksToMilliseconds(ticks);
+    float memory = float(peakMemory / (1024.0 * 1024.0));
 
-    struct argparse argparse;
-    argparse_init(&argparse, options, usages, 0);
-    argparse_describe(&argparse, nullptr, "\nMulti-threaded shader compiling & processing tool");
-    argparse_parse(&argparse, argc, argv);
-    
+    lock_guard<mutex> guard(g_TaskHistoryMutex);
+
+    auto [entry, isNew] = g_TaskHistory.try_emplace(GetTaskKey(taskData));
+    entry->second.sourceKey = Hash(taskData.source);
+
+    // Smooth out noise of a busy machine
+    entry->second.duration = isNew ? duration : (entry->second.duration + duration) * 0.5f;
+
+    // Underestimating memory is worse than overestimating
+    if (memory != 0.0f)
+        entry->second.memory = max(memory, (entry->second.memory + memory) * 0.5f);
+
+    g_IsTaskHistoryDirty = true;
+}
+
+//=====================================================================================================================
+// JOBSERVER
+//=====================================================================================================================
+
+// GNU make jobserver client (https://www.gnu.org/software/make/manual/html_node/Job-Slots.html). A compiler process
+// can only run with a token, so ShaderMake shares the parallelism budget of "make -jN" or Ninja. The process itself
+// owns one implicit token, others are read from and written back to the pipe or the named fifo
+class JobServer
+{
+public:
+    ~JobServer()
+    {
 #ifndef _WIN32
-    useAPI = false;
+        if (m_isReadFdOwned && m_readFd >= 0)
+            close(m_readFd);
 #endif
+    }
 
-    if (!config)
+    // Looks for "--jobserver-auth=R,W" or "--jobserver-auth=fifo:PATH" ("--jobserver-fds=R,W" in older versions) in
+    // "MAKEFLAGS". The last occurrence wins
+    bool Init()
     {
-        Printf(RED "ERROR: Config file not specified!\n");
+#ifdef _WIN32
         return false;
+#else
+        const char* makeFlags = getenv("MAKEFLAGS");
+        if (!makeFlags)
+            return false;
+
+        string auth;
+        istringstream flags(makeFlags);
+        string flag;
+        while (flags >> flag)
+        {
+            if (flag == "--")
+                break;
+
+            for (const char* prefix : {"--jobserver-auth=", "--jobserver-fds="})
+            {
+                size_t len = strlen(prefix);
+                if (flag.compare(0, len, prefix) == 0)
+                    auth = flag.substr(len);
+            }
+        }
+
+        if (auth.empty())
+            return false;
+
+        if (auth.compare(0, 5, "fifo:") == 0)
+        {
+            int fd = open(auth.c_str() + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0)
+            {
+                Printf(YELLOW "WARNING: Can't open the jobserver fifo '%s', using the local thread count!\n", auth.c_str() + 5);
+                return false;
+            }
+
+            m_readFd = fd;
+            m_writeFd = fd;
+            m_isReadFdOwned = true;
+        }
+        else
+        {
+            int readFd = -1, writeFd = -1;
+            if (sscanf(auth.c_str(), "%d,%d", &readFd, &writeFd) != 2)
+            {
+                Printf(YELLOW "WARNING: Unsupported jobserver '%s', using the local thread count!\n", auth.c_str());
+                return false;
+            }
+
+            // Negative or closed descriptors mean that ShaderMake is not marked as a recursive make ("+" prefix)
+            if (readFd < 0 || writeFd < 0 || fcntl(readFd, F_GETFD) == -1 || fcntl(writeFd, F_GETFD) == -1)
+            {
+                Printf(YELLOW "WARNING: The jobserver is unavailable (prefix the rule with '+'), using the local thread count!\n");
+                return false;
+            }
+
+            // Compilers don't need them
+            fcntl(readFd, F_SETFD, FD_CLOEXEC);
+            fcntl(writeFd, F_SETFD, FD_CLOEXEC);
+
+            // The pipe is shared with make, reopening gives an own non-blocking descriptor. A blocking read could hang
+            // forever, if other clients take the last token between "poll" and "read"
+#ifdef __linux__
+            string path = "/proc/self/fd/" + to_string(readFd);
+            int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+#else
+            int fd = -1;
+#endif
+            if (fd < 0)
+            {
+                Printf(YELLOW "WARNING: Can't get a non-blocking jobserver descriptor, using the local thread count!\n");
+                return false;
+            }
+
+            m_readFd = fd;
+            m_writeFd = writeFd;
+            m_isReadFdOwned = true;
+        }
+
+        m_hasImplicitToken = true;
+
+        return true;
+#endif
     }
 
-    if (!fs::exists(config))
+    bool IsActive() const
+    { return m_readFd >= 0; }
+
+    int GetReadFd() const
+    { return m_readFd; }
+
+    // Never blocks
+    bool TryAcquire(int& outToken)
     {
-        Printf(RED "ERROR: Config file '%s' does not exist!\n", config);
+        if (!IsActive())
+        {
+            outToken = NO_TOKEN;
+            return true;
+        }
+
+        {
+            lock_guard<mutex> guard(m_lock);
+            if (m_hasImplicitToken)
+            {
+                m_hasImplicitToken = false;
+                outToken = IMPLICIT_TOKEN;
+
+                return true;
+            }
+        }
+
+#ifndef _WIN32
+        uint8_t token;
+        ssize_t n = read(m_readFd, &token, 1);
+        if (n == 1)
+        {
+            outToken = token;
+            return true;
+        }
+
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            Printf(RED "ERROR: Can't read from the jobserver!\n");
+            g_Terminate = true;
+        }
+#endif
+
         return false;
     }
 
-    if (!outputDir)
+    // Blocks until a token is available. Returns "false" on termination
+    bool Acquire(int& outToken)
     {
-        Printf(RED "ERROR: Output directory not specified!\n");
+        while (!g_Terminate)
+        {
+            if (TryAcquire(outToken))
+                return true;
+
+#ifndef _WIN32
+            // Other processes compete for tokens, "poll" also allows termination
+            pollfd pfd = {m_readFd, POLLIN, 0};
+            poll(&pfd, 1, 100);
+#endif
+        }
+
         return false;
     }
 
-    if (!binary && !header && !binaryBlob && !headerBlob)
+    void Release(int token)
     {
-        Printf(RED "ERROR: One of 'binary', 'header', 'binaryBlob' or 'headerBlob' must be set!\n");
-        return false;
+        if (token == NO_TOKEN)
+            return;
+
+        if (token == IMPLICIT_TOKEN)
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_hasImplicitToken = true;
+
+            return;
+        }
+
+#ifndef _WIN32
+        // Tokens must be returned, otherwise the parent make loses its parallelism
+        uint8_t byte = (uint8_t)token;
+        while (write(m_writeFd, &byte, 1) != 1 && errno == EINTR)
+            ;
+#endif
     }
-    if (!platformName)
+
+    static constexpr int NO_TOKEN = -1;
+    static constexpr int IMPLICIT_TOKEN = -2;
+
+private:
+    mutex m_lock;
+    int m_readFd = -1;
+    int m_writeFd = -1;
+    bool m_hasImplicitToken = false;
+    bool m_isReadFdOwned = false;
+};
+
+JobServer g_JobServer;
+
+// Holds a jobserver token for the lifetime of a compilation
+class JobToken
+{
+public:
+    ~JobToken()
+    { g_JobServer.Release(m_token); }
+
+    bool Acquire()
+    { return g_JobServer.Acquire(m_token); }
+
+    bool TryAcquire()
+    { return g_JobServer.TryAcquire(m_token); }
+
+private:
+    int m_token = JobServer::NO_TOKEN;
+};
+
+//=====================================================================================================================
+// CPU LIMITS
+//=====================================================================================================================
+
+#ifdef __linux__
+
+// "cpu.max" (v2) or "cpu.cfs_quota_us" and "cpu.cfs_period_us" (v1) of a cgroup directory
+bool GetCgroupCpuQuota(const string& dir, bool isV2, uint32_t& outCpuNum)
+{
+    int64_t quota = -1, period = 0;
+
+    if (isV2)
     {
-        Printf(RED "ERROR: Platform not specified!\n");
+        ifstream stream(dir + "/cpu.max");
+        string max;
+        if (!(stream >> max >> period) || max == "max")
+            return false;
+
+        quota = atoll(max.c_str());
+    }
+    else
+    {
+        ifstream quotaStream(dir + "/cpu.cfs_quota_us");
+        ifstream periodStream(dir + "/cpu.cfs_period_us");
+        if (!(quotaStream >> quota) || !(periodStream >> period))
+            return false;
+    }
+
+    if (quota <= 0 || period <= 0)
         return false;
+
+    outCpuNum = (uint32_t)max((quota + period - 1) / period, (int64_t)1);
+
+    return true;
+}
+
+// The strictest CPU quota of the cgroup of the process and its ancestors, UINT32_MAX if unlimited
+uint32_t GetCgroupCpuLimit()
+{
+    // "id:controllers:path", where controllers are empty for v2
+    map<string, string> cgroupPaths; // key = controller, "" for v2
+    ifstream cgroups("/proc/self/cgroup");
+    for (string line; getline(cgroups, line);)
+    {
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == string::npos || second == string::npos)
+            continue;
+
+        string path = line.substr(second + 1);
+        istringstream controllers(line.substr(first + 1, second - first - 1));
+        string controller;
+        if (!getline(controllers, controller, ','))
+            cgroupPaths[""] = path;
+        else
+        {
+            do
+                cgroupPaths[controller] = path;
+            while (getline(controllers, controller, ','));
+        }
+    }
+
+    uint32_t limit = UINT32_MAX;
+
+    // "id parent major:minor root mountPoint options [optional fields] - fsType source superOptions"
+    ifstream mounts("/proc/self/mountinfo");
+    for (string line; getline(mounts, line);)
+    {
+        size_t separator = line.find(" - ");
+        if (separator == string::npos)
+            continue;
+
+        string id, parent, device, root, mountPoint, fsType, source, superOptions;
+        istringstream(line.substr(0, separator)) >> id >> parent >> device >> root >> mountPoint;
+        istringstream(line.substr(separator + 3)) >> fsType >> source >> superOptions;
+
+        bool isV2 = fsType == "cgroup2";
+        bool isV1 = fsType == "cgroup" && ("," + superOptions + ",").find(",cpu,") != string::npos;
+        if (!isV2 && !isV1)
+            continue;
+
+        auto found = cgroupPaths.find(isV2 ? "" : "cpu");
+        if (found == cgroupPaths.end())
+            continue;
+
+        // In a container the mounted hierarchy starts at the cgroup of the container
+        string path = found->second;
+        if (root != "/")
+            path = path.compare(0, root.size(), root) == 0 ? path.substr(root.size()) : string();
+
+        // Walk up to the mount point, a parent can be limited too
+        fs::path dir = fs::path(mountPoint + path).lexically_normal();
+        fs::path top = fs::path(mountPoint).lexically_normal();
+        while (true)
+        {
+            uint32_t cpuNum;
+            if (GetCgroupCpuQuota(PathToString(dir), isV2, cpuNum))
+                limit = min(limit, cpuNum);
+
+            if (dir == top || !dir.has_relative_path() || dir.parent_path() == dir)
+                break;
+
+            dir = dir.parent_path();
+        }
+    }
+
+    return limit;
+}
+
+#endif
+
+// The number of CPUs the process can actually use: the affinity mask and, on Linux, the cgroup CPU quota
+// (containers) can be smaller than "hardware_concurrency"
+uint32_t GetAvailableCpuNum(const char*& outOrigin)
+{
+    uint32_t cpuNum = max(thread::hardware_concurrency(), 1u);
+    outOrigin = "hardware threads";
+
+#ifdef _WIN32
+    DWORD_PTR processMask, systemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+    {
+        uint32_t affinityNum = 0;
+        for (; processMask; processMask &= processMask - 1)
+            affinityNum++;
+
+        if (affinityNum && affinityNum < cpuNum)
+        {
+            cpuNum = affinityNum;
+            outOrigin = "CPU affinity";
+        }
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        uint32_t affinityNum = (uint32_t)CPU_COUNT(&set);
+        if (affinityNum && affinityNum < cpuNum)
+        {
+            cpuNum = affinityNum;
+            outOrigin = "CPU affinity";
+        }
+    }
+
+    uint32_t quotaNum = GetCgroupCpuLimit();
+    if (quotaNum < cpuNum)
+    {
+        cpuNum = quotaNum;
+        outOrigin = "cgroup CPU quota";
+    }
+#endif
+
+    return cpuNum;
+}
+
+//=====================================================================================================================
+// MEMORY BUDGET
+//=====================================================================================================================
+
+// Physical memory, which can be used without swapping, UINT64_MAX if unknown
+uint64_t GetAvailableMemory()
+{
+#ifdef _WIN32
+    MEMORYSTATUSEX status = {};
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        return status.ullAvailPhys;
+#elif defined(__linux__)
+    ifstream meminfo("/proc/meminfo");
+    for (string line; getline(meminfo, line);)
+    {
+        if (line.compare(0, 13, "MemAvailable:") == 0)
+            return strtoull(line.c_str() + 13, nullptr, 10) * 1024;
+    }
+#endif
+
+    return UINT64_MAX;
+}
+
+// Admission control for compiler processes: a process starts only if its estimated peak memory fits into the rest of
+// the budget and into the available memory. A process always starts if nothing else is running
+class MemoryBudget
+{
+public:
+    void Init(uint64_t budget)
+    {
+        m_budget = budget;
+        m_reserved = 0;
+        m_runningNum = 0;
+        m_stallNum = 0;
+        m_stallTicks = 0;
     }
 
-    if (!compiler)
+    bool IsActive() const
+    { return m_budget != 0; }
+
+    uint64_t GetBudget() const
+    { return m_budget; }
+
+    uint32_t GetStallNum() const
+    { return m_stallNum; }
+
+    uint64_t GetStallTicks() const
+    { return m_stallTicks; }
+
+    // Blocks until the estimate fits. Returns "false" on termination
+    bool Acquire(uint64_t estimate)
+    {
+        unique_lock<mutex> lock(m_lock);
+
+        uint64_t stallStart = 0;
+        while (!g_Terminate)
+        {
+            if (Reserve(estimate))
+            {
+                if (stallStart)
+                {
+                    m_stallNum++;
+                    m_stallTicks += Timer_GetTicks() - stallStart;
+                }
+
+                return true;
+            }
+
+            if (!stallStart)
+                stallStart = Timer_GetTicks();
+
+            // Available memory can grow without a notification
+            m_condition.wait_for(lock, chrono::milliseconds(100));
+        }
+
+        return false;
+    }
+
+    bool TryAcquire(uint64_t estimate)
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        return Reserve(estimate);
+    }
+
+    // For callers of "TryAcquire", which wait on their own
+    void AddStall(uint64_t ticks)
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        m_stallNum++;
+        m_stallTicks += ticks;
+    }
+
+    void Release(uint64_t estimate)
+    {
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_reserved -= estimate;
+            m_runningNum--;
+        }
+
+        m_condition.notify_all();
+    }
+
+private:
+    bool Reserve(uint64_t estimate)
+    {
+        if (m_runningNum != 0 && (m_reserved + estimate > m_budget || estimate > GetAvailableMemory()))
+            return false;
+
+        m_reserved += estimate;
+        m_runningNum++;
+
+        return true;
+    }
+
+    mutex m_lock;
+    condition_variable m_condition;
+    uint64_t m_budget = 0;
+    uint64_t m_reserved = 0;
+    uint64_t m_stallTicks = 0;
+    uint32_t m_runningNum = 0;
+    uint32_t m_stallNum = 0;
+};
+
+MemoryBudget g_MemoryBudget;
+
+// Holds a part of the memory budget for the lifetime of a compilation
+class MemoryReservation
+{
+public:
+    ~MemoryReservation()
+    {
+        if (m_isAcquired)
+            g_MemoryBudget.Release(m_size);
+    }
+
+    bool Acquire(uint64_t size)
+    {
+        if (!g_MemoryBudget.IsActive())
+            return true;
+
+        m_size = size;
+        m_isAcquired = g_MemoryBudget.Acquire(size);
+
+        return m_isAcquired;
+    }
+
+    bool TryAcquire(uint64_t size)
+    {
+        if (!g_MemoryBudget.IsActive())
+            return true;
+
+        m_size = size;
+        m_isAcquired = g_MemoryBudget.TryAcquire(size);
+
+        return m_isAcquired;
+    }
+
+private:
+    uint64_t m_size = 0;
+    bool m_isAcquired = false;
+};
+
+//=====================================================================================================================
+// OPTIONS
+//=====================================================================================================================
+
+int AddInclude(struct argparse* self, const struct argparse_option* option)
+{ ((Options*)(option->data))->includeDirs.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+
+int AddGlobalDefine(struct argparse* self, const struct argparse_option* option)
+{ ((Options*)(option->data))->defines.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+
+int AddRelaxedInclude(struct argparse* self, const struct argparse_option* option)
+{ ((Options*)(option->data))->relaxedIncludes.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+
+int AddSpirvExtension(struct argparse* self, const struct argparse_option* option)
+{ ((Options*)(option->data))->spirvExtensions.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+
+int AddCompilerOptions(struct argparse* self, const struct argparse_option* option)
+{ ((Options*)(option->data))->compilerOptions.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+
+bool Options::Parse(int32_t argc, const char** argv)
+{
+    const char* config = nullptr;
+    const char* unused = nullptr; // storage for callbacks
+
+    struct argparse_option options[] = {
+        OPT_HELP(),
+        OPT_GROUP("Required options:"),
+            OPT_STRING('p', "platform", &platformName, "DXBC, DXIL or SPIRV", nullptr, 0, 0),
+            OPT_STRING('c', "config", &config, "Configuration file with the list of shaders to compile", nullptr, 0, 0),
+            OPT_STRING('o', "out", &outputDir, "Output directory", nullptr, 0, 0),
+            OPT_BOOLEAN('b', "binary", &binary, "Output binary files", nullptr, 0, 0),
+            OPT_BOOLEAN('h', "header", &header, "Output header files", nullptr, 0, 0),
+            OPT_BOOLEAN('B', "binaryBlob", &binaryBlob, "Output binary blob files", nullptr, 0, 0),
+            OPT_BOOLEAN('H', "headerBlob", &headerBlob, "Output header blob files", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "assembly", &assembly, "Output assembler files embedding binary and binary blob files via '.incbin'", nullptr, 0, 0),
+            OPT_STRING(0, "registry", &registry, "Output a registry header/source pair with a sorted index of all shaders and permutations", nullptr, 0, 0),
+            OPT_INTEGER(0, "registryDataFiles", &registryDataFiles, "Number of source files to spread the registry shader data over (default = 1)", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "typedPermutations", &typedPermutations, "Output a header per shader with typed permutation domains and index accessors", nullptr, 0, 0),
+            OPT_STRING(0, "depfile", &depfile, "Output a Makefile-syntax depfile with the config file, sources and includes of all outputs (for Ninja/Make)", nullptr, 0, 0),
+            OPT_STRING(0, "depfileTarget", &depfileTarget, "Target of the depfile, all outputs by default", nullptr, 0, 0),
+            OPT_STRING(0, "compiler", &compiler, "Path to a FXC/DXC/Slang compiler executable", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "slang", &slang, "Compiler is Slang", nullptr, 0, 0),
+        OPT_GROUP("Compiler settings:"),
+            OPT_STRING('m', "shaderModel", &shaderModel, "Shader model for DXIL/SPIRV (always SM 5.0 for DXBC)", nullptr, 0, 0),
+            OPT_INTEGER('O', "optimization", &optimizationLevel, "Optimization level 0-3 (default = 3, disabled = 0)", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "WX", &warningsAreErrors, "Maps to '-WX' DXC/FXC option: warnings are errors", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "allResourcesBound", &allResourcesBound, "Maps to '-all_resources_bound' DXC/FXC option: all resources bound", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "PDB", &pdb, "Output PDB files in 'out/PDB/' folder", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "embedPDB", &embedPdb, "Embed PDB with the shader binary", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "stripReflection", &stripReflection, "Maps to '-Qstrip_reflect' DXC/FXC option: strip reflection information from a shader binary", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "matrixRowMajor", &matrixRowMajor, "Maps to '-Zpr' DXC/FXC option: pack matrices in row-major order", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "hlsl2021", &hlsl2021, "Maps to '-HV 2021' DXC option: enable HLSL 2021 standard", nullptr, 0, 0),
+            OPT_STRING(0, "vulkanMemoryLayout", &vulkanMemoryLayout, "Maps to '-fvk-use-<VALUE>-layout' DXC options: dx, gl, scalar", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "slangHLSL", &slangHlsl, "Use HLSL compatibility mode when compiler is Slang", nullptr, 0, 0),
+            OPT_STRING('X', "compilerOptions", &unused, "Custom command line options for the compiler, separated by spaces", AddCompilerOptions, (intptr_t)this, 0),
+        OPT_GROUP("Defines & include directories:"),
+            OPT_STRING('I', "include", &unused, "Include directory(s)", AddInclude, (intptr_t)this, 0),
+            OPT_STRING('D', "define", &unused, "Macro definition(s) in forms 'M=value' or 'M'", AddGlobalDefine, (intptr_t)this, 0),
+        OPT_GROUP("Other options:"),
+            OPT_BOOLEAN('f', "force", &force, "Treat all source files as modified", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "compilerDeps", &compilerDeps, "Track dependencies reported by the compiler instead of scanning includes (DXC, Slang)", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "contentHash", &contentHash, "Detect modified shaders by content hashes of sources, includes and options instead of file times", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "explain", &explain, "Report why each task is being rebuilt", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "impact", &impact, "Report includes invalidating the most permutations", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "watch", &watch, "Stay resident and rebuild affected permutations when sources, includes or the config change", nullptr, 0, 0),
+            OPT_STRING(0, "sourceDir", &sourceDir, "Source code directory", nullptr, 0, 0),
+            OPT_STRING(0, "relaxedInclude", &unused, "Include file(s) not invoking re-compilation", AddRelaxedInclude, (intptr_t)this, 0),
+            OPT_STRING(0, "outputExt", &outputExt, "Extension for output files, default is one of .dxbc, .dxil, .spirv", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "serial", &serial, "Disable multi-threading", nullptr, 0, 0),
+            OPT_INTEGER('j', "jobs", &jobs, "Number of compiler processes (default = available CPUs, respecting affinity and cgroup CPU quota)", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "flatten", &flatten, "Flatten source directory structure in the output directory", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "continue", &continueOnError, "Continue compilation if an error is occured", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "useAPI", &useAPI, "Use FXC (d3dcompiler) or DXC (dxcompiler) API explicitly (Windows only)", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "colorize", &colorize, "Colorize console output", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "verbose", &verbose, "Print commands before they are executed", nullptr, 0, 0),
+            OPT_INTEGER(0, "memoryBudget", &memoryBudget, "Memory budget in MB for concurrently running compiler processes (default = unlimited)", nullptr, 0, 0),
+            OPT_INTEGER(0, "taskTimeout", &taskTimeout, "Time limit in seconds for a compiler process, timed out tasks are retried (default = unlimited)", nullptr, 0, 0),
+            OPT_INTEGER(0, "retryCount", &retryCount, "Retry count for compilation task sub-process failures", nullptr, 0, 0),
+        OPT_GROUP("SPIRV options:"),
+            OPT_STRING(0, "vulkanVersion", &vulkanVersion, "Vulkan environment version, maps to '-fspv-target-env' (default = 1.3)", nullptr, 0, 0),
+            OPT_STRING(0, "spirvExt", &unused, "Maps to '-fspv-extension' option: add SPIR-V extension permitted to use", AddSpirvExtension, (intptr_t)this, 0),
+            OPT_INTEGER(0, "sRegShift", &sRegShift, "SPIRV: register shift for sampler (s#) resources", nullptr, 0, 0),
+            OPT_INTEGER(0, "tRegShift", &tRegShift, "SPIRV: register shift for texture (t#) resources", nullptr, 0, 0),
+            OPT_INTEGER(0, "bRegShift", &bRegShift, "SPIRV: register shift for constant (b#) resources", nullptr, 0, 0),
+            OPT_INTEGER(0, "uRegShift", &uRegShift, "SPIRV: register shift for UAV (u#) resources", nullptr, 0, 0),
+            OPT_BOOLEAN(0, "noRegShifts", &noRegShifts, "Don't specify any register shifts for the compiler", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    static const char* usages[] = {
+        "ShaderMake.exe -p {DXBC|DXIL|SPIRV} --binary [--header --blob] -c \"path/to/config\"\n"
+        "\t-o \"path/to/output\" --compiler \"path/to/compiler\" [other options]\n"
+        "\t-D DEF1 -D DEF2=1 ... -I \"path1\" -I \"path2\" ...",
+        nullptr
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, nullptr, "\nMulti-threaded shader compiling & processing tool");
+    argparse_parse(&argparse, argc, argv);
+    
+#ifndef _WIN32
+    useAPI = false;
+#endif
+
+    if (!config)
+    {
+        Printf(RED "ERROR: Config file not specified!\n");
+        return false;
+    }
+
+    if (!fs::exists(config))
+    {
+        Printf(RED "ERROR: Config file '%s' does not exist!\n", config);
+        return false;
+    }
+
+    if (!outputDir)
+    {
+        Printf(RED "ERROR: Output directory not specified!\n");
+        return false;
+    }
+
+    if (!binary && !header && !binaryBlob && !headerBlob)
+    {
+        Printf(RED "ERROR: One of 'binary', 'header', 'binaryBlob' or 'headerBlob' must be set!\n");
+        return false;
+    }
+
+    if (assembly && !binary && !binaryBlob)
+    {
+        Printf(RED "ERROR: 'assembly' requires 'binary' or 'binaryBlob' to be set!\n");
+        return false;
+    }
+
+    if (registry)
+    {
+        if (!binary)
+        {
+            Printf(RED "ERROR: 'registry' requires 'binary' to be set!\n");
+            return false;
+        }
+
+        if (!IsIdentifier(registry))
+        {
+            Printf(RED "ERROR: Registry name '%s' must be a valid C++ identifier!\n", registry);
+            return false;
+        }
+
+        if (registryDataFiles == 0)
+        {
+            Printf(RED "ERROR: --registryDataFiles must be greater than 0.\n");
+            return false;
+        }
+    }
+    if (!platformName)
+    {
+        Printf(RED "ERROR: Platform not specified!\n");
+        return false;
+    }
+
+    if (!compiler)
+    {
+        Printf(RED "ERROR: Compiler not specified!\n");
+        return false;
+    }
+
+    if (!fs::exists(FindExecutable(compiler)))
+    {
+        Printf(RED "ERROR: Compiler '%s' does not exist!\n", compiler);
+        return false;
+    }
+    
+    if (slang && useAPI)
+    {
+        Printf(RED "ERROR: Use of Slang with --useAPI is not implemented.\n");
+        return false;
+    }
+
+    if (strlen(shaderModel) != 3 || strstr(shaderModel, "."))
+    {
+        Printf(RED "ERROR: Shader model ('%s') must have format 'X_Y'!\n", shaderModel);
+        return false;
+    }
+
+    // Platform
+    uint32_t i = 0;
+    for (; i < PLATFORMS_NUM; i++)
+    {
+        if (!strcmp(platformName, g_PlatformNames[i]))
+        {
+            platform = (Platform)i;
+            break;
+        }
+    }
+    if (i == PLATFORMS_NUM)
+    {
+        Printf(RED "ERROR: Unrecognized platform '%s'!\n", platformName);
+        return false;
+    }
+
+    if (outputExt)
+        g_OutputExt = outputExt;
+    else
+        g_OutputExt = g_PlatformExts[platform];
+
+    if (g_Options.vulkanMemoryLayout && platform != SPIRV)
+    {
+        Printf(RED "ERROR: --vulkanMemoryLayout is only supported for SPIRV target!\n");
+        return false;
+    }
+
+    if (g_Options.vulkanMemoryLayout && 
+        strcmp(g_Options.vulkanMemoryLayout, "dx") != 0 &&
+        strcmp(g_Options.vulkanMemoryLayout, "gl") != 0 && 
+        strcmp(g_Options.vulkanMemoryLayout, "scalar") != 0)
+    {
+        if (g_Options.slang && (strcmp(g_Options.vulkanMemoryLayout, "dx") == 0)) 
+        {
+            Printf(RED "ERROR: Unsupported value '%s' for --vulkanMemoryLayout! Only 'gl' and 'scalar' are supported for Slang.\n",
+                g_Options.vulkanMemoryLayout);
+        }
+        else {
+            Printf(RED "ERROR: Unsupported value '%s' for --vulkanMemoryLayout! Only 'dx', 'gl' and 'scalar' are supported.\n",
+                g_Options.vulkanMemoryLayout);
+        }
+        return false;
+    }
+
+    if (!g_Options.compilerOptions.empty() && g_Options.useAPI && g_Options.platform == Platform::DXBC)
+    {
+        Printf(RED "ERROR: --compilerOptions is not compatible with '--platform DXBC --useAPI'!\n");
+        return false;
+    }
+
+    if (g_Options.retryCount < 0)
+    {
+        Printf(RED "ERROR: --retryCount must be greater than or equal to 0.\n");
+        return false;
+    }
+
+    if (g_Options.jobs < 0)
+    {
+        Printf(RED "ERROR: --jobs must be greater than or equal to 0.\n");
+        return false;
+    }
+
+    if (g_Options.memoryBudget < 0)
+    {
+        Printf(RED "ERROR: --memoryBudget must be greater than or equal to 0.\n");
+        return false;
+    }
+
+    if (g_Options.taskTimeout < 0)
+    {
+        Printf(RED "ERROR: --taskTimeout must be greater than or equal to 0.\n");
+        return false;
+    }
+
+    // Absolute path is needed for source files to get "clickable" messages
+#ifdef _WIN32
+    char cd[MAX_PATH];
+    if (!GetCurrentDirectoryA(sizeof(cd), cd))
+#else
+    char cd[PATH_MAX];
+    if (!getcwd(cd, sizeof(cd)))
+#endif
+    {
+        Printf(RED "ERROR: Cannot get the working directory!\n");
+        return false;
+    }
+
+    configFile = fs::path(cd) / fs::path(config);
+
+    for (fs::path& path : includeDirs)
+        path = configFile.parent_path() / path;
+
+    return true;
+}
+
+int AddLocalDefine(struct argparse* self, const struct argparse_option* option)
+{ ((ConfigLine*)(option->data))->defines.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+
+bool ConfigLine::Parse(int32_t argc, const char** argv)
+{
+    source = argv[0];
+
+    const char* unused = nullptr; // storage for the callback
+    struct argparse_option options[] = {
+        OPT_STRING('T', "profile", &profile, "Shader profile", nullptr, 0, 0),
+        OPT_STRING('E', "entryPoint", &entryPoint, "(Optional) entry point", nullptr, 0, 0),
+        OPT_STRING('D', "define", &unused, "(Optional) define(s) in forms 'M=value' or 'M'", AddLocalDefine, (intptr_t)this, 0),
+        OPT_STRING('o', "output", &outputDir, "(Optional) output subdirectory", nullptr, 0, 0),
+        OPT_INTEGER('O', "optimization", &optimizationLevel, "(Optional) optimization level", nullptr, 0, 0),
+        OPT_STRING(0, "outputSuffix", &outputSuffix, "(Optional) Suffix to add before extension after filename", nullptr, 0, 0),
+        OPT_END(),
+    };
+
+    static const char* usages[] = {
+        "path/to/shader -T profile [-E entry -O{0|1|2|3} -o \"output/subdirectory\" --outputSuffix \"suffix\" -D DEF1={0,1} -D DEF2={0,1,2} -D DEF3 ...]",
+        nullptr
+    };
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usages, 0);
+    argparse_describe(&argparse, nullptr, "\nConfiguration options for a shader");
+    argparse_parse(&argparse, argc, argv);
+
+    // If there are some non-option elements in the config line, they will remain in the argv array.
+    if (argv[0])
+    {
+        Printf(RED "ERROR: Unrecognized element in the config line: '%s'!\n", argv[0]);
+        return false;
+    }
+
+    if (!profile)
+    {
+        Printf(RED "ERROR: Shader target not specified!\n");
+        return false;
+    }
+
+    return true;
+}
+
+//=====================================================================================================================
+// FXC/DXC API
+//=====================================================================================================================
+#ifdef _WIN32
+
+void TokenizeDefineStrings(vector<string>& in, vector<D3D_SHADER_MACRO>& out)
+{
+    if (in.empty())
+        return;
+
+    out.reserve(out.size() + in.size());
+    for (const string& defineString : in)
+    {
+        D3D_SHADER_MACRO& define = out.emplace_back();
+        char* s = (char*)defineString.c_str(); // IMPORTANT: "defineString" gets split into tokens divided by '\0'
+        define.Name = strtok(s, "=");
+        define.Definition = strtok(nullptr, "=");
+    }
+}
+
+class FxcIncluder : public ID3DInclude
+{
+public:
+    FxcIncluder(const fs::path& sourceFile)
+    {
+        includeDirs.reserve(g_Options.includeDirs.size() + 8);
+
+        includeDirs.push_back(sourceFile.parent_path());
+        for (const fs::path& path : g_Options.includeDirs)
+            includeDirs.push_back(path);
+    }
+
+    ~FxcIncluder()
+    {}
+
+    STDMETHOD(Open)(THIS_ D3D_INCLUDE_TYPE includeType, LPCSTR pFileName, LPCVOID pParentData, LPCVOID *ppData, UINT *pBytes)
+    {
+        // TODO: an error in an include file gets reported using relative path with recent WinSDKs, what makes it 
+        // "unclickable" from the Visual Studio output window. It doesn't look like an issue of "FxcIncluder",
+        // because the issue is here even with "D3D_COMPILE_STANDARD_FILE_INCLUDE", but "FXC.exe" works fine.
+
+        UNUSED(includeType);
+        UNUSED(pParentData);
+
+        *ppData = 0;
+        *pBytes = 0;
+
+        // Find file
+        fs::path name = fs::path(pFileName);
+        fs::path file = name;
+        if (file.is_relative())
+        {
+            for (const fs::path& path : includeDirs)
+            {
+                file = path / name;
+                if (fs::exists(file))
+                    break;
+            }
+        }
+
+        // Open file
+        FILE* stream = fopen(file.string().c_str(), "rb");
+        if (!stream)
+            return E_FAIL;
+
+        // Load file
+        uint32_t len = GetFileLength(stream);
+        char* buf = (char*)malloc(len);
+        if (!buf)
+            return E_FAIL;
+
+        fread(buf, 1, len, stream);
+        fclose(stream);
+
+        *ppData = buf;
+        *pBytes = len;
+
+        // Add the path to this file to the current include stack so that any sub-includes would be relative to this path
+        includeDirs.push_back(file.parent_path());
+
+        // Remember what has been read
+        openedFiles.push_back(PathToString(fs::absolute(file)));
+
+        return S_OK;
+    }
+
+    STDMETHOD(Close)(THIS_ LPCVOID pData)
+    {
+        if (pData)
+        {
+            // Pop the path for the innermost included file from the include stack
+            includeDirs.pop_back();
+
+            // Release the data
+            free((void*)pData);
+        }
+
+        return S_OK;
+    }
+
+    vector<string> openedFiles;
+
+private:
+    vector<fs::path> includeDirs;
+};
+
+// Forwards to the default include handler, remembering what has been read
+class DxcIncludeRecorder : public IDxcIncludeHandler
+{
+public:
+    DxcIncludeRecorder(IDxcIncludeHandler* defaultIncludeHandler, vector<string>& openedFiles) :
+        m_defaultIncludeHandler(defaultIncludeHandler), m_openedFiles(openedFiles)
+    {}
+
+    HRESULT STDMETHODCALLTYPE LoadSource(LPCWSTR pFilename, IDxcBlob** ppIncludeSource) override
+    {
+        HRESULT hr = m_defaultIncludeHandler->LoadSource(pFilename, ppIncludeSource);
+        if (SUCCEEDED(hr))
+            m_openedFiles.push_back(PathToString(fs::absolute(fs::path(pFilename))));
+
+        return hr;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override
+    {
+        if (riid == __uuidof(IDxcIncludeHandler) || riid == __uuidof(IUnknown))
+        {
+            *ppvObject = this;
+            return S_OK;
+        }
+
+        *ppvObject = nullptr;
+
+        return E_NOINTERFACE;
+    }
+
+    // Lives on the stack
+    ULONG STDMETHODCALLTYPE AddRef() override
+    { return 1; }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    { return 1; }
+
+private:
+    IDxcIncludeHandler* m_defaultIncludeHandler;
+    vector<string>& m_openedFiles;
+};
+
+void FxcCompile(uint32_t workerIndex)
+{
+    static const uint32_t optimizationLevelRemap[] = {
+        D3DCOMPILE_SKIP_OPTIMIZATION,
+        D3DCOMPILE_OPTIMIZATION_LEVEL1,
+        D3DCOMPILE_OPTIMIZATION_LEVEL2,
+        D3DCOMPILE_OPTIMIZATION_LEVEL3,
+    };
+
+    vector<D3D_SHADER_MACRO> optionsDefines;
+    vector<string> tokenizedDefines = g_Options.defines;
+    TokenizeDefineStrings(tokenizedDefines, optionsDefines);
+
+    while (!g_Terminate)
+    {
+        // Getting a task in the current thread
+        uint32_t taskIndex;
+        if (!g_TaskScheduler.Pop(workerIndex, taskIndex))
+            return;
+
+        TaskData& taskData = g_TaskData[taskIndex];
+        uint64_t startTicks = Timer_GetTicks();
+        fs::file_time_type startTime = fs::file_time_type::clock::now();
+
+        // Tokenize DXBC defines
+        vector<D3D_SHADER_MACRO> defines = optionsDefines;
+        TokenizeDefineStrings(taskData.defines, defines);
+        defines.push_back({nullptr, nullptr});
+
+        // Args
+        uint32_t compilerFlags = (g_Options.pdb ? (D3DCOMPILE_DEBUG | D3DCOMPILE_DEBUG_NAME_FOR_BINARY) : 0) |
+            (g_Options.allResourcesBound ? D3DCOMPILE_ALL_RESOURCES_BOUND : 0) |
+            (g_Options.warningsAreErrors ? D3DCOMPILE_WARNINGS_ARE_ERRORS : 0) |
+            (g_Options.matrixRowMajor ? D3DCOMPILE_PACK_MATRIX_ROW_MAJOR : 0) |
+            optimizationLevelRemap[taskData.optimizationLevel];
+
+        // Compiling the shader
+        fs::path sourceFile = g_Options.configFile.parent_path() / g_Options.sourceDir / taskData.source;
+
+        FxcIncluder fxcIncluder(sourceFile);
+        string profile = taskData.profile + "_5_0";
+
+        ComPtr<ID3DBlob> codeBlob;
+        ComPtr<ID3DBlob> errorBlob;
+        HRESULT hr = D3DCompileFromFile(
+            sourceFile.wstring().c_str(),
+            defines.data(),
+            &fxcIncluder,
+            taskData.entryPoint.c_str(),
+            profile.c_str(),
+            compilerFlags, 0,
+            &codeBlob,
+            &errorBlob);
+
+        bool isSucceeded = SUCCEEDED(hr) && codeBlob;
+
+        if (g_Terminate)
+            break;
+
+        // Dump PDB
+        if (isSucceeded && g_Options.pdb)
+        {
+            // Retrieve the debug info part of the shader
+            ComPtr<ID3DBlob> pdb;
+            D3DGetBlobPart(codeBlob->GetBufferPointer(), codeBlob->GetBufferSize(), D3D_BLOB_PDB, 0, &pdb);
+
+            // Retrieve the suggested name for the debug data file
+            ComPtr<ID3DBlob> pdbName;
+            D3DGetBlobPart(codeBlob->GetBufferPointer(), codeBlob->GetBufferSize(), D3D_BLOB_DEBUG_NAME, 0, &pdbName);
+
+            // This struct represents the first four bytes of the name blob
+            struct ShaderDebugName
+            {
+                uint16_t Flags;       // Reserved, must be set to zero
+                uint16_t NameLength;  // Length of the debug name, without null terminator
+                                      // Followed by NameLength bytes of the UTF-8-encoded name
+                                      // Followed by a null terminator
+                                      // Followed by [0-3] zero bytes to align to a 4-byte boundary
+            };
+
+            auto pDebugNameData = (const ShaderDebugName*)(pdbName->GetBufferPointer());
+            auto pName = (const char*)(pDebugNameData + 1);
+
+            string file = fs::path(taskData.outputFileWithoutExt).parent_path().string() + "/" + PDB_DIR + "/" + pName;
+            FILE* fp = fopen(file.c_str(), "wb");
+            if (fp)
+            {
+                fwrite(pdb->GetBufferPointer(), pdb->GetBufferSize(), 1, fp);
+                fclose(fp);
+            }
+        }
+
+        // Strip reflection
+        ComPtr<ID3DBlob> strippedBlob;
+        if (g_Options.stripReflection && isSucceeded)
+        {
+            D3DStripShader(codeBlob->GetBufferPointer(), codeBlob->GetBufferSize(), D3DCOMPILER_STRIP_REFLECTION_DATA | D3DCOMPILER_STRIP_DEBUG_INFO, &strippedBlob);
+            codeBlob = strippedBlob;
+        }
+
+        // Dump output
+        if (isSucceeded)
+            isSucceeded = DumpShader(taskData, (uint8_t*)codeBlob->GetBufferPointer(), codeBlob->GetBufferSize());
+
+        // Gather dependencies
+        if (isSucceeded && g_Options.compilerDeps)
+        {
+            vector<string> dependencies = {PathToString(fs::absolute(sourceFile))};
+            dependencies.insert(dependencies.end(), fxcIncluder.openedFiles.begin(), fxcIncluder.openedFiles.end());
+
+            SetCompilerDependencies(taskData, dependencies, startTime);
+        }
+
+        // Update progress
+        if (isSucceeded)
+            UpdateTaskHistory(taskData, Timer_GetTicks() - startTicks, 0);
+
+        UpdateProgress(taskData, isSucceeded, false, errorBlob ? (char*)errorBlob->GetBufferPointer() : nullptr);
+
+        // Terminate if this shader failed and "--continue" is not set
+        if (g_Terminate)
+            break;
+    }
+}
+
+void DxcCompile(uint32_t workerIndex)
+{
+    static const wchar_t* optimizationLevelRemap[] = {
+        // Note: if you're getting errors like "error C2065: 'DXC_ARG_SKIP_OPTIMIZATIONS': undeclared identifier" here,
+        // please update the Windows SDK to at least version 10.0.20348.0.
+        DXC_ARG_SKIP_OPTIMIZATIONS,
+        DXC_ARG_OPTIMIZATION_LEVEL1,
+        DXC_ARG_OPTIMIZATION_LEVEL2,
+        DXC_ARG_OPTIMIZATION_LEVEL3,
+    };
+
+    // Gather SPIRV register shifts once
+    static const wchar_t* regShiftArgs[] = {
+        L"-fvk-s-shift",
+        L"-fvk-t-shift",
+        L"-fvk-b-shift",
+        L"-fvk-u-shift",
+    };
+
+    vector<wstring> regShifts;
+    if (!g_Options.noRegShifts)
+    {
+        for (uint32_t reg = 0; reg < 4; reg++)
+        {
+            for (uint32_t space = 0; space < SPIRV_SPACES_NUM; space++)
+            {
+                wchar_t buf[64];
+
+                regShifts.push_back(regShiftArgs[reg]);
+
+                swprintf(buf, COUNT_OF(buf), L"%u", (&g_Options.sRegShift)[reg]);
+                regShifts.push_back(wstring(buf));
+
+                swprintf(buf, COUNT_OF(buf), L"%u", space);
+                regShifts.push_back(wstring(buf));
+            }
+        }
+    }
+
+    // TODO: is a global instance thread safe?
+    ComPtr<IDxcCompiler3> dxcCompiler;
+    HRESULT hr = DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(&dxcCompiler));
+    if (FAILED(hr))
+    {
+        // Print a message explaining that we cannot compile anything.
+        // This can happen when the user specifies a DXC version that is too old.
+        lock_guard<mutex> guard(g_TaskMutex);
+        static bool once = true;
+        if (once)
+        {
+            Printf(RED "ERROR: Cannot create an instance of IDxcCompiler3, HRESULT = 0x%08x (%s)\n", hr, std::system_category().message(hr).c_str());
+            once = false;
+        }
+        g_Terminate = true;
+        return;
+    }
+
+    ComPtr<IDxcUtils> dxcUtils;
+    hr = DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(&dxcUtils));
+    if (FAILED(hr))
+    {
+        // Also print an error message.
+        // Not sure if this ever happens or all such cases are handled by the condition above, but let's be safe.
+        lock_guard<mutex> guard(g_TaskMutex);
+        static bool once = true;
+        if (once)
+        {
+            Printf(RED "ERROR: Cannot create an instance of IDxcUtils, HRESULT = 0x%08x (%s)\n", hr, std::system_category().message(hr).c_str());
+            once = false;
+        }
+        g_Terminate = true;
+        return;
+    }
+
+    while (!g_Terminate)
+    {
+        // Getting a task in the current thread
+        uint32_t taskIndex;
+        if (!g_TaskScheduler.Pop(workerIndex, taskIndex))
+            return;
+
+        TaskData& taskData = g_TaskData[taskIndex];
+        uint64_t startTicks = Timer_GetTicks();
+        fs::file_time_type startTime = fs::file_time_type::clock::now();
+
+        // Compiling the shader
+        fs::path sourceFile = g_Options.configFile.parent_path() / g_Options.sourceDir / taskData.source;
+        wstring wsourceFile = sourceFile.wstring();
+
+        ComPtr<IDxcBlob> codeBlob;
+        ComPtr<IDxcBlobEncoding> errorBlob;
+        vector<string> dependencies = {PathToString(fs::absolute(sourceFile))};
+        bool isSucceeded = false;
+
+        ComPtr<IDxcBlobEncoding> sourceBlob;
+        hr = dxcUtils->LoadFile(wsourceFile.c_str(), nullptr, &sourceBlob);
+
+        if (SUCCEEDED(hr))
+        {
+            vector<wstring> args;
+            args.reserve(16 + (g_Options.defines.size() + taskData.defines.size() + g_Options.includeDirs.size()) * 2
+                + (g_Options.platform == SPIRV ? regShifts.size() + g_Options.spirvExtensions.size() : 0));
+
+            // Source file
+            args.push_back(wsourceFile);
+
+            // Profile
+            args.push_back(L"-T");
+            args.push_back(AnsiToWide(taskData.profile + "_" + g_Options.shaderModel));
+
+            // Entry point
+            args.push_back(L"-E");
+            args.push_back(AnsiToWide(taskData.entryPoint));
+
+            // Defines
+            for (const string& define : g_Options.defines)
+            {
+                args.push_back(L"-D");
+                args.push_back(AnsiToWide(define));
+            }
+            for (const string& define : taskData.defines)
+            {
+                args.push_back(L"-D");
+                args.push_back(AnsiToWide(define));
+            }
+
+            // Include directories
+            for (const fs::path& path : g_Options.includeDirs)
+            {
+                args.push_back(L"-I");
+                args.push_back(path.wstring());
+            }
+
+            // Args
+            args.push_back(optimizationLevelRemap[taskData.optimizationLevel]);
+
+            uint32_t shaderModelIndex = (g_Options.shaderModel[0] - '0') * 10 + (g_Options.shaderModel[2] - '0');
+            if (shaderModelIndex >= 62)
+                args.push_back(L"-enable-16bit-types");
+
+            if (g_Options.warningsAreErrors)
+                args.push_back(DXC_ARG_WARNINGS_ARE_ERRORS);
+
+            if (g_Options.allResourcesBound)
+                args.push_back(DXC_ARG_ALL_RESOURCES_BOUND);
+
+            if (g_Options.matrixRowMajor)
+                args.push_back(DXC_ARG_PACK_MATRIX_ROW_MAJOR);
+
+            if (g_Options.hlsl2021)
+            {
+                args.push_back(L"-HV");
+                args.push_back(L"2021");
+            }
+
+            if (g_Options.pdb||g_Options.embedPdb)
+            {
+                // TODO: for SPIRV PDB can only be embedded, GetOutput(DXC_OUT_PDB) silently fails...
+                args.push_back(L"-Zi");
+                args.push_back(L"-Zsb"); // only binary code affects hash
+            }
+            
+            if (g_Options.embedPdb)
+                args.push_back(L"-Qembed_debug");
+
+            if (g_Options.platform == SPIRV)
+            {
+                args.push_back(L"-spirv");
+                args.push_back(wstring(L"-fspv-target-env=vulkan") + AnsiToWide(g_Options.vulkanVersion));
+
+                if (g_Options.vulkanMemoryLayout)
+                    args.push_back(wstring(L"-fvk-use-") + AnsiToWide(g_Options.vulkanMemoryLayout) + wstring(L"-layout"));
+
+                for (const string& ext : g_Options.spirvExtensions)
+                    args.push_back(wstring(L"-fspv-extension=") + AnsiToWide(ext));
+
+                for (const wstring& arg : regShifts)
+                    args.push_back(arg);
+            }
+            else // Not supported by SPIRV gen
+            {
+                if (g_Options.stripReflection)
+                    args.push_back(L"-Qstrip_reflect");
+            }
+
+            for (string const& options : g_Options.compilerOptions)
+            {
+                TokenizeCompilerOptions(options.c_str(), args);
+            }
+
+            // Debug output
+            if (g_Options.verbose)
+            {
+                wstringstream cmd;
+                for (const wstring& arg : args)
+                {
+                    cmd << arg;
+                    cmd << L" ";
+                }
+
+                Printf(WHITE "%ls\n", cmd.str().c_str());
+            }
+
+            // Now that args are finalized, get their C-string pointers into a vector
+            vector<const wchar_t*> argPointers;
+            argPointers.reserve(args.size());
+            for (const wstring& arg : args)
+                argPointers.push_back(arg.c_str());
+
+            // Compiling the shader
+            DxcBuffer sourceBuffer = {};
+            sourceBuffer.Ptr = sourceBlob->GetBufferPointer();
+            sourceBuffer.Size = sourceBlob->GetBufferSize();
+
+            ComPtr<IDxcIncludeHandler> pDefaultIncludeHandler;
+            dxcUtils->CreateDefaultIncludeHandler(&pDefaultIncludeHandler);
+
+            DxcIncludeRecorder includeRecorder(pDefaultIncludeHandler.Get(), dependencies);
+
+            ComPtr<IDxcResult> dxcResult;
+            hr = dxcCompiler->Compile(&sourceBuffer, argPointers.data(), (uint32_t)args.size(), &includeRecorder, IID_PPV_ARGS(&dxcResult));
+
+            if (SUCCEEDED(hr))
+                dxcResult->GetStatus(&hr);
+
+            if (dxcResult)
+            {
+                dxcResult->GetResult(&codeBlob);
+                dxcResult->GetErrorBuffer(&errorBlob);
+            }
+
+            isSucceeded = SUCCEEDED(hr) && codeBlob;
+
+            // Dump PDB
+            if (isSucceeded && g_Options.pdb)
+            {
+                ComPtr<IDxcBlob> pdb;
+                ComPtr<IDxcBlobUtf16> pdbName;
+                if (SUCCEEDED(dxcResult->GetOutput(DXC_OUT_PDB, IID_PPV_ARGS(&pdb), &pdbName)))
+                {
+                    wstring file = fs::path(taskData.outputFileWithoutExt).parent_path().wstring() + L"/" + _L(PDB_DIR) + L"/" + wstring(pdbName->GetStringPointer());
+                    FILE* fp = _wfopen(file.c_str(), L"wb");
+                    if (fp)
+                    {
+                        fwrite(pdb->GetBufferPointer(), pdb->GetBufferSize(), 1, fp);
+                        fclose(fp);
+                    }
+                }
+            }
+        }
+
+        if (g_Terminate)
+            break;
+
+        // Dump output
+        if (isSucceeded)
+            isSucceeded = DumpShader(taskData, (uint8_t*)codeBlob->GetBufferPointer(), codeBlob->GetBufferSize());
+
+        // Gather dependencies
+        if (isSucceeded && g_Options.compilerDeps)
+            SetCompilerDependencies(taskData, dependencies, startTime);
+
+        // Update progress
+        if (isSucceeded)
+            UpdateTaskHistory(taskData, Timer_GetTicks() - startTicks, 0);
+
+        UpdateProgress(taskData, isSucceeded, false, errorBlob ? (char*)errorBlob->GetBufferPointer() : nullptr);
+    }
+}
+
+#endif
+
+//=====================================================================================================================
+// EXE
+//=====================================================================================================================
+
+// Compiler arguments, which are the same for all tasks
+struct SharedCompilerArguments
+{
+    vector<string> prefix; // compiler and global options
+    vector<string> defines; // global defines, they go after defines of a task
+    vector<string> suffix; // custom options, they go after all others
+};
+
+SharedCompilerArguments g_SharedCompilerArguments;
+
+// An argument vector for the compiler executable, which refers to shared arguments instead of copying them
+class CompilerCommand
+{
+public:
+    CompilerCommand()
+    {
+        m_argv.reserve(g_SharedCompilerArguments.prefix.size() + 32);
+        m_argv.push_back(nullptr);
+
+        AddShared(g_SharedCompilerArguments.prefix);
+    }
+
+    // Must outlive the command
+    void AddShared(const vector<string>& args)
+    {
+        for (const string& arg : args)
+            Push(arg.c_str());
+    }
+
+    // Tokenized "-X" options. The shell gets them as they were specified
+    void AddCustomOptions()
+    {
+        m_customOptionsBegin = m_argv.size() - 1;
+        AddShared(g_SharedCompilerArguments.suffix);
+        m_customOptionsEnd = m_argv.size() - 1;
+    }
+
+    void Add(string arg)
+    {
+        m_storage.push_back(move(arg));
+        Push(m_storage.back().c_str());
+    }
+
+    // Null-terminated
+    char* const* GetArgv() const
+    { return (char* const*)m_argv.data(); }
+
+    // For logging and fingerprinting, arguments are quoted only if they have spaces
+    string ToString(size_t firstArg = 0, size_t lastArg = SIZE_MAX) const
+    {
+        string s;
+        for (size_t i = firstArg; i + 1 < m_argv.size() && i < lastArg; i++)
+        {
+            if (i != firstArg)
+                s += ' ';
+
+            s += EscapePath(m_argv[i]);
+        }
+
+        return s;
+    }
+
+#ifdef _WIN32
+    // "COMPILER" is set in "main" (workaround for quoting in "cmd.exe")
+    string ToShellCommand() const
+    {
+        if (m_customOptionsBegin == SIZE_MAX)
+            return "%COMPILER% " + ToString(1) + " 2>&1";
+
+        string s = "%COMPILER% " + ToString(1, m_customOptionsBegin);
+        for (const string& options : g_Options.compilerOptions)
+            s += " " + options;
+
+        return s + " " + ToString(m_customOptionsEnd) + " 2>&1";
+    }
+#endif
+
+private:
+    void Push(const char* arg)
+    {
+        m_argv.back() = arg;
+        m_argv.push_back(nullptr);
+    }
+
+    vector<const char*> m_argv;
+    deque<string> m_storage; // doesn't move strings on growth
+    size_t m_customOptionsBegin = SIZE_MAX;
+    size_t m_customOptionsEnd = SIZE_MAX;
+};
+
+void InitSharedCompilerArguments()
+{
+    vector<string>& args = g_SharedCompilerArguments.prefix;
+    args = {g_Options.compiler};
+
+    auto addRegisterShifts = [&]()
+    {
+        if (g_Options.noRegShifts)
+            return;
+
+        for (uint32_t space = 0; space < SPIRV_SPACES_NUM; space++)
+        {
+            string spaceString = to_string(space);
+            args.insert(args.end(), {"-fvk-s-shift", to_string(g_Options.sRegShift), spaceString});
+            args.insert(args.end(), {"-fvk-t-shift", to_string(g_Options.tRegShift), spaceString});
+            args.insert(args.end(), {"-fvk-b-shift", to_string(g_Options.bRegShift), spaceString});
+            args.insert(args.end(), {"-fvk-u-shift", to_string(g_Options.uRegShift), spaceString});
+        }
+    };
+
+    if (g_Options.slang)
+    {
+        // Slang defaults to slang language mode unless -lang <other language> sets something else.
+        // For HLSL compatibility mode:
+        //    - use -lang hlsl to set language mode to HLSL
+        //    - use -unscoped-enums so Slang doesn't require all enums to be scoped
+        if (g_Options.slangHlsl)
+        {
+            // Language mode: hlsl
+            args.insert(args.end(), {"-lang", "hlsl"});
+
+            // Treat enums as unscoped
+            args.push_back("-unscoped-enum");
+        }
+
+        // Target/platform
+        args.insert(args.end(), {"-target", g_PlatformSlangTargets[g_Options.platform]});
+
+        // Include directories
+        for (const fs::path& dir : g_Options.includeDirs)
+            args.insert(args.end(), {"-I", dir.string()});
+
+        // Warnings as errors
+        if (g_Options.warningsAreErrors)
+            args.push_back("-warnings-as-errors");
+
+        // Matrix layout
+        if (g_Options.matrixRowMajor)
+            args.push_back("-matrix-layout-row-major");
+        else
+            args.push_back("-matrix-layout-column-major");
+
+        if (g_Options.platform == SPIRV)
+        {
+            // Uses the entrypoint name from the source instead of 'main' in the SPIRV output
+            args.push_back("-fvk-use-entrypoint-name");
+
+            if (g_Options.vulkanMemoryLayout)
+            {
+                if (strcmp(g_Options.vulkanMemoryLayout, "scalar") == 0)
+                    args.push_back("-force-glsl-scalar-layout");
+                else if (strcmp(g_Options.vulkanMemoryLayout, "gl") == 0)
+                    args.push_back("-fvk-use-gl-layout");
+            }
+
+            addRegisterShifts();
+        }
+    }
+    else
+    {
+        args.push_back("-nologo");
+
+        // Include directories
+        for (const fs::path& dir : g_Options.includeDirs)
+            args.insert(args.end(), {"-I", dir.string()});
+
+        // Args
+        uint32_t shaderModelIndex = (g_Options.shaderModel[0] - '0') * 10 + (g_Options.shaderModel[2] - '0');
+        if (g_Options.platform != DXBC && shaderModelIndex >= 62)
+            args.push_back("-enable-16bit-types");
+
+        if (g_Options.warningsAreErrors)
+            args.push_back("-WX");
+
+        if (g_Options.allResourcesBound)
+            args.push_back("-all_resources_bound");
+
+        if (g_Options.matrixRowMajor)
+            args.push_back("-Zpr");
+
+        if (g_Options.hlsl2021)
+            args.insert(args.end(), {"-HV", "2021"});
+
+        if (g_Options.pdb || g_Options.embedPdb)
+            args.insert(args.end(), {"-Zi", "-Zsb"}); // only binary affects hash
+
+        if (g_Options.embedPdb)
+            args.push_back("-Qembed_debug");
+
+        if (g_Options.platform == SPIRV)
+        {
+            args.push_back("-spirv");
+            args.push_back(string("-fspv-target-env=vulkan") + g_Options.vulkanVersion);
+
+            if (g_Options.vulkanMemoryLayout)
+                args.push_back(string("-fvk-use-") + g_Options.vulkanMemoryLayout + "-layout");
+
+            for (const string& ext : g_Options.spirvExtensions)
+                args.push_back("-fspv-extension=" + ext);
+
+            addRegisterShifts();
+        }
+        else if (g_Options.stripReflection) // Not supported by SPIRV gen
+            args.push_back("-Qstrip_reflect");
+    }
+
+    // Defines
+    g_SharedCompilerArguments.defines.clear();
+    for (const string& define : g_Options.defines)
+        g_SharedCompilerArguments.defines.insert(g_SharedCompilerArguments.defines.end(), {"-D", define});
+
+    // Custom options
+    g_SharedCompilerArguments.suffix.clear();
+    for (const string& options : g_Options.compilerOptions)
+        TokenizeCompilerOptions(options.c_str(), g_SharedCompilerArguments.suffix);
+}
+
+// Builds a command line for the compiler executable. If "depFile" is set, Slang also writes dependencies of the
+// compilation into it, while DXC (which only preprocesses in this mode) gets a dependency pass command instead
+void GetCompilerCommand(const TaskData& taskData, const string& outputFile, const string& depFile, CompilerCommand& cmd)
+{
+    static const char* optimizationLevelRemap[] = {
+        "-Od",
+        "-O1",
+        "-O2",
+        "-O3",
+    };
+
+    bool isDependencyPass = !g_Options.slang && !depFile.empty();
+
+    if (g_Options.slang)
+    {
+        // Profile
+        cmd.Add("-profile");
+        cmd.Add(taskData.profile + "_" + g_Options.shaderModel);
+
+        // Output
+        cmd.Add("-o");
+        cmd.Add(outputFile);
+
+        // Dependencies
+        if (!depFile.empty())
+        {
+            cmd.Add("-depfile");
+            cmd.Add(depFile);
+        }
+
+        // Entry point
+        if (taskData.profile != "lib")
+        {
+            // Don't specify entry if profile is lib_*, Slang will use the entry point currently
+            cmd.Add("-entry");
+            cmd.Add(taskData.entryPoint);
+        }
+    }
+    else
+    {
+        // Output file
+        if (isDependencyPass)
+        {
+            cmd.Add("-M");
+            cmd.Add("-MF");
+            cmd.Add(depFile);
+        }
+        else if (g_Options.binary || g_Options.binaryBlob || (g_Options.headerBlob && !taskData.combinedDefines.empty()))
+        {
+            cmd.Add("-Fo");
+            cmd.Add(outputFile);
+        }
+
+        if (!isDependencyPass && (g_Options.header || (g_Options.headerBlob && taskData.combinedDefines.empty())))
+        {
+            cmd.Add("-Fh");
+            cmd.Add(outputFile + ".h");
+            cmd.Add("-Vn");
+            cmd.Add(GetShaderName(taskData.outputFileWithoutExt));
+        }
+
+        // Profile
+        string profile = taskData.profile + "_";
+        if (g_Options.platform == DXBC)
+            profile += "5_0";
+        else
+            profile += g_Options.shaderModel;
+
+        cmd.Add("-T");
+        cmd.Add(profile);
+
+        // Entry point
+        cmd.Add("-E");
+        cmd.Add(taskData.entryPoint);
+    }
+
+    // Defines
+    for (const string& define : taskData.defines)
+    {
+        cmd.Add("-D");
+        cmd.Add(define);
+    }
+
+    cmd.AddShared(g_SharedCompilerArguments.defines);
+
+    // Optimization level
+    if (g_Options.slang)
+        cmd.Add("-O" + to_string(taskData.optimizationLevel));
+    else
+        cmd.Add(optimizationLevelRemap[taskData.optimizationLevel]);
+
+    // Not supported by SPIRV gen
+    if (!g_Options.slang && g_Options.platform != SPIRV && g_Options.pdb && !isDependencyPass)
+    {
+        fs::path pdbPath = fs::path(outputFile).parent_path() / PDB_DIR;
+        cmd.Add("-Fd");
+        cmd.Add(pdbPath.string() + "/"); // only binary code affects hash
+    }
+
+    // Custom options
+    cmd.AddCustomOptions();
+
+    // Source file
+    fs::path sourceFile = g_Options.configFile.parent_path() / g_Options.sourceDir / taskData.source;
+    cmd.Add(sourceFile.string());
+}
+
+// Runs the compiler like "popen", but without a shell in between (on POSIX), also reports the peak memory usage of the
+// process (POSIX only). Both "stdout" and "stderr" are captured
+class ChildProcess
+{
+public:
+    ~ChildProcess()
+    { Finish(); }
+
+    // Sets "errno" on failure
+    bool Start(const CompilerCommand& cmd)
+    {
+#ifdef _WIN32
+        m_output = popen(cmd.ToShellCommand().c_str(), "r");
+#else
+        // Not inherited by processes, which other workers start at the same time, otherwise EOF can be delayed
+        int fds[2];
+#ifdef __linux__
+        if (pipe2(fds, O_CLOEXEC) != 0)
+            return false;
+#else
+        // Not atomic, so starting processes is serialized, otherwise the descriptors can leak into a process started
+        // by another worker in between
+        static mutex spawnLock;
+        lock_guard<mutex> spawnGuard(spawnLock);
+
+        if (pipe(fds) != 0)
+            return false;
+
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+
+        // An own process group allows to terminate the compiler along with its children
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attributes, 0);
+
+        // Searches "PATH" like the shell did for a bare compiler name
+        char* const* argv = cmd.GetArgv();
+        int result = posix_spawnp(&m_pid, argv[0], &actions, &attributes, argv, environ);
+
+        posix_spawnattr_destroy(&attributes);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+
+        if (result != 0)
+        {
+            close(fds[0]);
+            m_pid = -1;
+            errno = result;
+
+            return false;
+        }
+
+        m_output = fdopen(fds[0], "r");
+        if (!m_output)
+            close(fds[0]);
+#endif
+
+        return m_output != nullptr;
+    }
+
+    FILE* GetOutput() const
+    { return m_output; }
+
+#ifndef _WIN32
+    // For polling, "fgets" must not be used then
+    int GetOutputFd() const
+    { return m_output ? fileno(m_output) : -1; }
+
+    void CloseOutput()
+    {
+        if (m_output)
+        {
+            fclose(m_output);
+            m_output = nullptr;
+        }
+    }
+
+    pid_t GetPid() const
+    { return m_pid; }
+
+    // To the whole process group
+    void Signal(int sig)
+    {
+        if (m_pid > 0)
+            kill(-m_pid, sig);
+    }
+#endif
+
+    uint64_t GetPeakMemory() const
+    { return m_peakMemory; }
+
+    // Returns the exit status in "pclose" format
+    int Finish()
+    {
+#ifdef _WIN32
+        int result = m_output ? pclose(m_output) : -1;
+        m_output = nullptr;
+
+        return result;
+#else
+        if (m_output)
+        {
+            fclose(m_output);
+            m_output = nullptr;
+        }
+
+        if (m_pid <= 0)
+        {
+            errno = ECHILD;
+            return -1;
+        }
+
+        int status = 0;
+        struct rusage usage = {};
+        pid_t result;
+        while ((result = wait4(m_pid, &status, 0, &usage)) == -1 && errno == EINTR)
+            ;
+
+        m_pid = -1;
+        if (result == -1)
+            return -1;
+
+#ifdef __APPLE__
+        m_peakMemory = (uint64_t)usage.ru_maxrss; // bytes
+#else
+        m_peakMemory = (uint64_t)usage.ru_maxrss * 1024; // KB
+#endif
+
+        return status;
+#endif
+    }
+
+private:
+    FILE* m_output = nullptr;
+    uint64_t m_peakMemory = 0;
+#ifndef _WIN32
+    pid_t m_pid = -1;
+#endif
+};
+
+bool ReadBinaryFile(const char* file, vector<uint8_t>& outData)
+{
+    FILE* stream = fopen(file, "rb");
+    if (!stream)
+    {
+        Printf(RED "ERROR: Can't open file '%s'!\n", file);
+        return false;
+    }
+
+    uint32_t const binarySize = GetFileLength(stream);
+    if (binarySize == 0)
+    {
+        Printf(RED "ERROR: Binary file '%s' is empty!\n", file);
+        fclose(stream);
+        return false;
+    }
+
+    // Warn if the file is suspiciously large
+    if (binarySize > (64 << 20)) // > 64Mb
+        Printf(YELLOW "WARNING: Binary file '%s' is too large!\n", file);
+
+    // Allocate memory foe the whole file
+    outData.resize(binarySize);
+
+    // Read the file
+    size_t bytesRead = fread(outData.data(), 1, binarySize, stream);
+    bool success = (bytesRead == binarySize);
+
+    fclose(stream);
+    return success;
+}
+
+
+// A compilation of a task by the compiler executable, optionally followed by the DXC dependency pass
+struct ExeCompilation
+{
+    JobToken token;
+    MemoryReservation memory;
+    ChildProcess process;
+    string message;
+    string output; // collected by the event loop
+    string outputFile;
+    string depFile;
+    fs::file_time_type startTime; // for dependencies modified during compilation
+    uint64_t startTicks = 0;
+    uint64_t processStartTicks = 0;
+    uint64_t terminateTicks = 0; // when SIGTERM was sent
+    uint64_t peakMemory = 0;
+    uint32_t taskIndex = 0;
+    bool isSucceeded = false;
+    bool willRetry = false;
+    bool isDependencyPass = false;
+    bool isDependencyPassFailed = false;
+    bool isTimedOut = false;
+    bool isCanceled = false;
+    bool isKilled = false;
+};
+
+void AddCompilerOutput(ExeCompilation& compilation, const char* line)
+{
+    // Ignore useless unmutable FXC message
+    if (strstr(line, "compilation object save succeeded"))
+        return;
+
+    compilation.message += line;
+}
+
+bool StartExeCompilation(ExeCompilation& compilation)
+{
+    TaskData& taskData = g_TaskData[compilation.taskIndex];
+    compilation.startTicks = Timer_GetTicks();
+    compilation.startTime = fs::file_time_type::clock::now();
+    compilation.outputFile = taskData.outputFileWithoutExt + g_OutputExt;
+
+    // FXC can't report dependencies
+    if (g_Options.compilerDeps && (g_Options.slang || g_Options.platform != DXBC))
+        compilation.depFile = compilation.outputFile + ".d";
+
+    // Building command line
+    CompilerCommand cmd;
+    GetCompilerCommand(taskData, compilation.outputFile, g_Options.slang ? compilation.depFile : string(), cmd);
+
+    // Debug output
+    if (g_Options.verbose)
+        Printf(WHITE "%s\n", cmd.ToString().c_str());
+
+    // Compiling the shader
+    compilation.processStartTicks = Timer_GetTicks();
+    if (compilation.process.Start(cmd))
+        return true;
+
+    // Retry if count > 0 and the system is temporarily out of processes or memory
+    if (g_TaskRetryCount > 0 && (errno == EAGAIN || errno == ENOMEM))
+        compilation.willRetry = true;
+    else
+        compilation.message += string("ERROR: Can't run '") + g_Options.compiler + "': " + strerror(errno) + "\n";
+
+    return false;
+}
+
+// Terminates the process group of the compiler on timeout or interruption: SIGTERM first, then SIGKILL if the
+// processes are still there after a grace period
+void SuperviseExeCompilation(ExeCompilation& compilation)
+{
+#ifdef _WIN32
+    UNUSED(compilation);
+#else
+    uint64_t now = Timer_GetTicks();
+
+    if (!compilation.terminateTicks)
+    {
+        if (g_IsInterrupted)
+            compilation.isCanceled = true;
+        else if (g_Options.taskTimeout && Timer_ConvertTicksToMilliseconds(now - compilation.processStartTicks) > g_Options.taskTimeout * 1000.0)
+            compilation.isTimedOut = true;
+        else
+            return;
+
+        compilation.process.Signal(SIGTERM);
+        compilation.terminateTicks = now;
+    }
+    else if (!compilation.isKilled && Timer_ConvertTicksToMilliseconds(now - compilation.terminateTicks) > KILL_GRACE_PERIOD)
+    {
+        compilation.process.Signal(SIGKILL);
+        compilation.isKilled = true;
+    }
+#endif
+}
+
+// Collects the output until the compiler closes it. On POSIX the process is supervised meanwhile
+void ReadExeOutput(ExeCompilation& compilation)
+{
+#ifdef _WIN32
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), compilation.process.GetOutput()))
+        compilation.output += buf;
+#else
+    int fd = compilation.process.GetOutputFd();
+    while (true)
+    {
+        SuperviseExeCompilation(compilation);
+
+        pollfd pfd = {fd, POLLIN, 0};
+        int result = poll(&pfd, 1, 100);
+        if (result == 0 || (result < 0 && errno == EINTR))
+            continue;
+
+        // On a poll error reading still waits for the end of the output, just without supervision
+        char buf[4096];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n > 0)
+            compilation.output.append(buf, (size_t)n);
+        else if (n == 0 || errno != EINTR)
+            break;
+    }
+#endif
+}
+
+// "result" is the exit status of the compiler process
+void OnExeCompiled(ExeCompilation& compilation, int result)
+{
+    TaskData& taskData = g_TaskData[compilation.taskIndex];
+    const string& outputFile = compilation.outputFile;
+    compilation.peakMemory = compilation.process.GetPeakMemory();
+
+    istringstream lines(compilation.output);
+    for (string line; getline(lines, line);)
+        AddCompilerOutput(compilation, (line + "\n").c_str());
+
+    // Check status, see https://pubs.opengroup.org/onlinepubs/009696699/functions/pclose.html
+    const bool childProcessError = (result == -1 && errno == ECHILD);
+
+    if (compilation.isCanceled)
+        return;
+
+    // A hung compiler can succeed next time
+    if (compilation.isTimedOut)
+    {
+        compilation.message += "ERROR: Timed out after " + to_string(g_Options.taskTimeout) + " s!\n";
+        compilation.willRetry = g_TaskRetryCount > 0;
+    }
+    else if (result == 0)
+        compilation.isSucceeded = true;
+
+    // Retry if count > 0 and failed to wait for the child sub-process
+    else if (g_TaskRetryCount > 0 && childProcessError)
+        compilation.willRetry = true;
+
+    // Slang cannot produce .h files directly, so we convert its binary output to .h here if needed
+    bool convertBinaryOutputToHeader = g_Options.slang && (g_Options.header || (g_Options.headerBlob && taskData.combinedDefines.empty()));
+    if (compilation.isSucceeded && convertBinaryOutputToHeader)
+    {
+        vector<uint8_t> buffer;
+        if (ReadBinaryFile(outputFile.c_str(), buffer))
+        {
+            string headerFile = taskData.outputFileWithoutExt + g_OutputExt + ".h";
+            DataOutputContext context(headerFile.c_str(), true);
+            if (context.stream)
+            {
+                string shaderName = GetShaderName(taskData.outputFileWithoutExt);
+                context.WriteTextPreamble(shaderName.c_str());
+                context.WriteDataAsText(buffer.data(), buffer.size());
+                context.WriteTextEpilog();
+
+                // Delete the binary file if it's not requested
+                if (!g_Options.binary)
+                    fs::remove(outputFile);
+            }
+            else
+            {
+                Printf(RED "ERROR: Failed to open file '%s' for writing!\n", headerFile.c_str());
+                compilation.isSucceeded = false;
+            }
+        }
+        else
+            compilation.isSucceeded = false;
+    }
+
+    // Embed the binary into an assembler file if needed
+    if (compilation.isSucceeded && g_Options.assembly && IsBinaryOutput(taskData))
+        compilation.isSucceeded = WriteAssembly(outputFile, GetShaderName(taskData.outputFileWithoutExt));
+}
+
+// DXC needs a separate preprocessing pass to report dependencies. Its output is only shown if it fails
+bool StartDependencyPass(ExeCompilation& compilation)
+{
+    if (!compilation.isSucceeded || compilation.depFile.empty() || g_Options.slang)
+        return false;
+
+    CompilerCommand cmd;
+    GetCompilerCommand(g_TaskData[compilation.taskIndex], compilation.outputFile, compilation.depFile, cmd);
+
+    if (g_Options.verbose)
+        Printf(WHITE "%s\n", cmd.ToString().c_str());
+
+    compilation.isDependencyPass = true;
+    compilation.output.clear();
+    compilation.processStartTicks = Timer_GetTicks();
+    compilation.terminateTicks = 0;
+    compilation.isKilled = false;
+
+    if (compilation.process.Start(cmd))
+        return true;
+
+    compilation.isDependencyPassFailed = true;
+    if (g_Options.verbose)
+        Printf(YELLOW "WARNING: Can't run the dependency pass for '%s': %s. Falling back to include scanning.\n", compilation.outputFile.c_str(), strerror(errno));
+
+    return false;
+}
+
+// The depfile of a failed dependency pass is missing or incomplete, the include scanner is used for the task instead.
+// A terminated compiler can exit with 0 after writing a part of the depfile
+void OnDependencyPassFinished(ExeCompilation& compilation, int result)
+{
+    if (compilation.isCanceled)
+        return;
+
+    if (compilation.isTimedOut || compilation.isKilled)
+    {
+        compilation.isDependencyPassFailed = true;
+        if (g_Options.verbose)
+            Printf(YELLOW "WARNING: The dependency pass for '%s' timed out. Falling back to include scanning.\n", compilation.outputFile.c_str());
+    }
+    else if (result != 0)
+    {
+        compilation.isDependencyPassFailed = true;
+        if (g_Options.verbose)
+            Printf(YELLOW "WARNING: The dependency pass for '%s' failed with status %d. Falling back to include scanning.\n%s", compilation.outputFile.c_str(), result, compilation.output.c_str());
+    }
+}
+
+void FinishExeCompilation(ExeCompilation& compilation, uint32_t workerIndex)
+{
+    TaskData& taskData = g_TaskData[compilation.taskIndex];
+
+    // Interrupted by the user, outputs can be incomplete
+    if (compilation.isCanceled)
+    {
+        UpdateManifest(taskData, false);
+        return;
+    }
+
+    // Gather dependencies reported by the compiler. Without them the manifest entry has no dependencies, so the next
+    // run scans includes of the task
+    if (compilation.isSucceeded && !compilation.depFile.empty())
+    {
+        vector<string> dependencies;
+        if (!compilation.isDependencyPassFailed && ReadDepfile(compilation.depFile, dependencies))
+            SetCompilerDependencies(taskData, dependencies, compilation.startTime);
+        else
+            taskData.dependencies.clear();
+
+        error_code ec;
+        fs::remove(compilation.depFile, ec);
+    }
+
+    if (compilation.isSucceeded)
+        UpdateTaskHistory(taskData, Timer_GetTicks() - compilation.startTicks, compilation.peakMemory);
+
+    // Update progress
+    UpdateProgress(taskData, compilation.isSucceeded, compilation.willRetry, compilation.message.c_str());
+
+    // If retrying, requeue the task and try again without counting failure or terminating
+    if (compilation.willRetry)
+        g_TaskScheduler.Push(workerIndex, compilation.taskIndex);
+}
+
+// One worker thread per compiler process
+void ExeCompile(uint32_t workerIndex)
+{
+    while (!g_Terminate)
+    {
+        ExeCompilation compilation;
+
+        // Waiting for a jobserver token first, so a waiting worker doesn't hold a task, which others could steal
+        if (!compilation.token.Acquire())
+            return;
+
+        // Getting a task in the current thread
+        if (!g_TaskScheduler.Pop(workerIndex, compilation.taskIndex))
+            return;
+
+        // Waiting until the compiler process fits into the memory budget
+        if (!compilation.memory.Acquire(g_TaskData[compilation.taskIndex].memoryEstimate))
+            return;
+
+        if (StartExeCompilation(compilation))
+        {
+            ReadExeOutput(compilation);
+            OnExeCompiled(compilation, compilation.process.Finish());
+
+            if (StartDependencyPass(compilation))
+            {
+                ReadExeOutput(compilation);
+                OnDependencyPassFinished(compilation, compilation.process.Finish());
+            }
+        }
+
+        FinishExeCompilation(compilation, workerIndex);
+    }
+}
+
+#ifdef __linux__
+
+int OpenPidFd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    UNUSED(pid);
+    return -1;
+#endif
+}
+
+// Runs up to "jobsNum" compiler processes from the calling thread. Output pipes and exits of the processes (pidfd,
+// Linux 5.3+) are multiplexed with epoll, completions are handled as they arrive. Returns "false" if epoll is not
+// available
+bool ExeCompileEventLoop(uint32_t jobsNum)
+{
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+        return false;
+
+    // Event data: "slot * 2" for the output pipe, "slot * 2 + 1" for the pidfd
+    constexpr uint64_t JOBSERVER_EVENT = UINT64_MAX;
+
+    struct Slot
+    {
+        unique_ptr<ExeCompilation> compilation;
+        int outputFd = -1;
+        int pidFd = -1; // stays -1 if pidfd is not supported, the exit is awaited after the output is closed then
+    };
+
+    vector<Slot> slots(jobsNum);
+    vector<uint32_t> freeSlots;
+    for (uint32_t i = jobsNum; i > 0; i--)
+        freeSlots.push_back(i - 1);
+
+    auto watch = [&](uint32_t slotIndex)
+    {
+        Slot& slot = slots[slotIndex];
+        ChildProcess& process = slot.compilation->process;
+
+        slot.outputFd = process.GetOutputFd();
+        fcntl(slot.outputFd, F_SETFL, fcntl(slot.outputFd, F_GETFL) | O_NONBLOCK);
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = slotIndex * 2;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, slot.outputFd, &event);
+
+        slot.pidFd = OpenPidFd(process.GetPid());
+        if (slot.pidFd >= 0)
+        {
+            event.data.u64 = slotIndex * 2 + 1;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, slot.pidFd, &event);
+        }
+    };
+
+    auto release = [&](uint32_t slotIndex)
+    {
+        slots[slotIndex].compilation.reset();
+        freeSlots.push_back(slotIndex);
+    };
+
+    auto complete = [&](uint32_t slotIndex)
+    {
+        ExeCompilation& compilation = *slots[slotIndex].compilation;
+        int result = compilation.process.Finish();
+
+        if (compilation.isDependencyPass)
+            OnDependencyPassFinished(compilation, result);
+        else
+        {
+            OnExeCompiled(compilation, result);
+
+            if (StartDependencyPass(compilation))
+            {
+                watch(slotIndex);
+                return;
+            }
+        }
+
+        FinishExeCompilation(compilation, 0);
+        release(slotIndex);
+    };
+
+    unique_ptr<ExeCompilation> pending;
+    bool hasPendingToken = false;
+    bool hasPendingTask = false;
+    bool isJobServerWatched = false;
+    uint64_t memoryStallStart = 0;
+
+    while (true)
+    {
+        // Start compilations while there are free slots, tasks, tokens and memory. A task is taken first, so the
+        // jobserver is not touched if there is nothing to do
+        bool isWaitingForToken = false;
+        while (!g_Terminate && !freeSlots.empty())
+        {
+            if (!pending)
+                pending = make_unique<ExeCompilation>();
+
+            if (!hasPendingTask)
+            {
+                if (!g_TaskScheduler.Pop(0, pending->taskIndex))
+                    break;
+
+                hasPendingTask = true;
+            }
+
+            if (!hasPendingToken)
+            {
+                if (!pending->token.TryAcquire())
+                {
+                    isWaitingForToken = true;
+                    break;
+                }
+
+                hasPendingToken = true;
+            }
+
+            if (!pending->memory.TryAcquire(g_TaskData[pending->taskIndex].memoryEstimate))
+            {
+                if (!memoryStallStart)
+                    memoryStallStart = Timer_GetTicks();
+                break;
+            }
+
+            if (memoryStallStart)
+            {
+                g_MemoryBudget.AddStall(Timer_GetTicks() - memoryStallStart);
+                memoryStallStart = 0;
+            }
+
+            uint32_t slotIndex = freeSlots.back();
+            freeSlots.pop_back();
+
+            slots[slotIndex].compilation = move(pending);
+            hasPendingToken = false;
+            hasPendingTask = false;
+
+            if (StartExeCompilation(*slots[slotIndex].compilation))
+                watch(slotIndex);
+            else
+            {
+                FinishExeCompilation(*slots[slotIndex].compilation, 0);
+                release(slotIndex);
+            }
+        }
+
+        // Nothing is running, so nothing can free a token or memory: all tasks are done or terminated
+        if (freeSlots.size() == jobsNum)
+            break;
+
+        if (isWaitingForToken != isJobServerWatched)
+        {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u64 = JOBSERVER_EVENT;
+            epoll_ctl(epollFd, isWaitingForToken ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, g_JobServer.GetReadFd(), &event);
+
+            isJobServerWatched = isWaitingForToken;
+        }
+
+        for (Slot& slot : slots)
+        {
+            if (slot.compilation)
+                SuperviseExeCompilation(*slot.compilation);
+        }
+
+        // The timeout also picks up termination requests, task timeouts and memory freed by other processes
+        epoll_event events[64];
+        int eventNum = epoll_wait(epollFd, events, COUNT_OF(events), 100);
+        for (int i = 0; i < eventNum; i++)
+        {
+            uint64_t data = events[i].data.u64;
+            if (data == JOBSERVER_EVENT)
+                continue;
+
+            uint32_t slotIndex = uint32_t(data >> 1);
+            Slot& slot = slots[slotIndex];
+            if (!slot.compilation)
+                continue;
+
+            if (data & 1)
+            {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, slot.pidFd, nullptr);
+                close(slot.pidFd);
+                slot.pidFd = -1;
+            }
+            else
+            {
+                char buf[4096];
+                ssize_t n;
+                while ((n = read(slot.outputFd, buf, sizeof(buf))) > 0)
+                    slot.compilation->output.append(buf, (size_t)n);
+
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, slot.outputFd, nullptr);
+                    slot.compilation->process.CloseOutput();
+                    slot.outputFd = -1;
+                }
+            }
+
+            if (slot.outputFd < 0 && slot.pidFd < 0)
+                complete(slotIndex);
+        }
+    }
+
+    close(epollFd);
+
+    return true;
+}
+
+#endif
+
+//=====================================================================================================================
+// STATE FILES
+//=====================================================================================================================
+
+// State files persist data between runs in "outputDir/.ShaderMake/config.PLATFORM.ext"
+fs::path GetStateFile(const char* ext)
+{
+    string name = g_Options.configFile.filename().string() + "." + g_Options.platformName + ext;
+
+    return fs::path(g_Options.outputDir) / STATE_DIR / name;
+}
+
+class StateFileWriter
+{
+public:
+    StateFileWriter(uint32_t signature, uint32_t version)
+    {
+        Write(signature);
+        Write(version);
+    }
+
+    template<typename T>
+    void Write(const T& value)
+    {
+        const uint8_t* bytes = (const uint8_t*)&value;
+        m_data.insert(m_data.end(), bytes, bytes + sizeof(T));
+    }
+
+    void WriteString(const string& s)
+    {
+        Write((uint32_t)s.size());
+        m_data.insert(m_data.end(), s.begin(), s.end());
+    }
+
+    // Writes into a temporary file first, so a concurrent or interrupted run never sees a partial file
+    bool Save(const fs::path& file) const
+    {
+        error_code ec;
+        fs::create_directories(file.parent_path(), ec);
+
+        fs::path tempFile = file;
+        tempFile += ".tmp";
+
+        {
+            DataOutputContext context(PathToString(tempFile).c_str(), false);
+            if (!context.stream || !context.WriteDataAsBinary(m_data.data(), m_data.size()))
+                return false;
+        }
+
+        fs::rename(tempFile, file, ec);
+
+        return !ec;
+    }
+
+private:
+    vector<uint8_t> m_data;
+};
+
+class StateFileReader
+{
+public:
+    // A missing, foreign or corrupted file reads as empty
+    StateFileReader(const fs::path& file, uint32_t signature, uint32_t version)
+    {
+        FILE* stream = fopen(PathToString(file).c_str(), "rb");
+        if (!stream)
+            return;
+
+        m_data.resize(GetFileLength(stream));
+        m_isValid = fread(m_data.data(), 1, m_data.size(), stream) == m_data.size();
+        fclose(stream);
+
+        m_isValid = m_isValid && Read<uint32_t>() == signature && Read<uint32_t>() == version;
+    }
+
+    template<typename T>
+    T Read()
+    {
+        T value = {};
+        if (m_isValid && m_offset + sizeof(T) <= m_data.size())
+        {
+            memcpy(&value, m_data.data() + m_offset, sizeof(T));
+            m_offset += sizeof(T);
+        }
+        else
+            m_isValid = false;
+
+        return value;
+    }
+
+    string ReadString()
+    {
+        uint32_t size = Read<uint32_t>();
+        if (!m_isValid || m_offset + size > m_data.size())
+        {
+            m_isValid = false;
+            return string();
+        }
+
+        string s((const char*)m_data.data() + m_offset, size);
+        m_offset += size;
+
+        return s;
+    }
+
+    inline bool IsValid() const
+    { return m_isValid; }
+
+    inline bool IsEnd() const
+    { return m_offset == m_data.size(); }
+
+private:
+    vector<uint8_t> m_data;
+    size_t m_offset = 0;
+    bool m_isValid = false;
+};
+
+//=====================================================================================================================
+// INCLUDE SCANNER
+//=====================================================================================================================
+
+// Read-only view of a whole file
+class MappedFile
+{
+public:
+    MappedFile(const fs::path& file)
+    {
+#ifdef _WIN32
+        HANDLE handle = CreateFileW(file.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER size = {};
+        m_isOpen = GetFileSizeEx(handle, &size) != 0;
+        m_size = (size_t)size.QuadPart;
+
+        if (m_isOpen && m_size)
+        {
+            HANDLE mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping)
+            {
+                m_data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+            m_isOpen = m_data != nullptr;
+        }
+
+        CloseHandle(handle);
+#else
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd == -1)
+            return;
+
+        struct stat info = {};
+        m_isOpen = fstat(fd, &info) == 0;
+        m_size = (size_t)info.st_size;
+
+        if (m_isOpen && m_size)
+        {
+            void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            m_data = data == MAP_FAILED ? nullptr : (const char*)data;
+            m_isOpen = m_data != nullptr;
+        }
+
+        close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+        if (!m_data)
+            return;
+
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        munmap((void*)m_data, m_size);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    inline const char* GetData() const
+    { return m_data; }
+
+    inline size_t GetSize() const
+    { return m_data ? m_size : 0; }
+
+    inline bool IsOpen() const
+    { return m_isOpen; }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_isOpen = false;
+};
+
+inline const char* SkipToLineEnd(const char* p, const char* end)
+{
+    // Respects line continuations
+    const char* begin = p;
+    while (p < end)
+    {
+        p = (const char*)memchr(p, '\n', end - p);
+        if (!p)
+            return end;
+
+        const char* q = p;
+        if (q > begin && q[-1] == '\r')
+            q--;
+        if (q == begin || q[-1] != '\\')
+            return p;
+
+        p++;
+    }
+
+    return end;
+}
+
+inline const char* SkipBlockComment(const char* p, const char* end)
+{
+    // "p" points after "/*"
+    for (; p + 1 < end; p++)
+    {
+        p = (const char*)memchr(p, '*', end - p - 1);
+        if (!p)
+            return end;
+
+        if (p[1] == '/')
+            return p + 2;
+    }
+
+    return end;
+}
+
+inline const char* SkipHorizontalSpaces(const char* p, const char* end)
+{
+    while (p < end)
+    {
+        if (*p == ' ' || *p == '\t' || *p == '\f' || *p == '\v')
+            p++;
+        else if (*p == '/' && p + 1 < end && p[1] == '*')
+            p = SkipBlockComment(p + 2, end);
+        else if (*p == '\\' && p + 1 < end && (p[1] == '\n' || p[1] == '\r'))
+            p += (p[1] == '\r' && p + 2 < end && p[2] == '\n') ? 3 : 2;
+        else
+            break;
+    }
+
+    return p;
+}
+
+// Returns the text of a directive up to the end of the line, without comments and line continuations
+string GetDirectiveText(const char* p, const char* end)
+{
+    string text;
+    while (p < end && *p != '\n')
+    {
+        if ((*p == '\\' && p + 1 < end && (p[1] == '\n' || p[1] == '\r')) || (*p == '/' && p + 1 < end && p[1] == '*'))
+        {
+            p = SkipHorizontalSpaces(p, end);
+            text += ' ';
+        }
+        else if (*p == '/' && p + 1 < end && p[1] == '/')
+            break;
+        else
+            text += *p++;
+    }
+
+    while (!text.empty() && isspace((uint8_t)text.back()))
+        text.pop_back();
+
+    size_t first = text.find_first_not_of(" \t\f\v");
+
+    return first == string::npos ? string() : text.substr(first);
+}
+
+// Single pass over the text, which collects "#include" names outside of comments, string literals and "#if 0" blocks,
+// along with conditions of enclosing "#if" blocks, and names of macros defined or undefined in the file
+void ScanIncludes(const char* p, const char* end, vector<ScannedInclude>& includes, vector<string>& macros)
+{
+    struct Conditional
+    {
+        string active; // condition of the current branch
+        string prior; // all previous branches are not taken
+        bool isActive;
+        bool isTaken; // a branch known to be true has been seen
+    };
+
+    vector<Conditional> conditionals;
+    uint32_t inactiveNum = 0;
+    bool isLineStart = true;
+
+    auto getCondition = [](const string& text) -> int
+    {
+        if (text == "0" || text == "1")
+            return text[0] - '0';
+
+        return -1; // unknown
+    };
+
+    auto join = [](const string& a, const string& b) -> string
+    {
+        if (a.empty())
+            return b;
+        if (b.empty())
+            return a;
+
+        return a + " && " + b;
+    };
+
+    auto enterBranch = [&](Conditional& conditional, const string& text, int condition)
+    {
+        conditional.isActive = !conditional.isTaken && condition != 0;
+
+        if (conditional.isActive)
+        {
+            conditional.active = condition == 1 ? conditional.prior : join(conditional.prior, "(" + text + ")");
+            if (condition == -1)
+                conditional.prior = join(conditional.prior, "!(" + text + ")");
+        }
+
+        conditional.isTaken |= condition == 1;
+    };
+
+    while (p < end)
+    {
+        char ch = *p;
+
+        if (ch == '\n')
+        {
+            isLineStart = true;
+            p++;
+        }
+        else if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\f' || ch == '\v')
+            p++;
+        else if (ch == '/' && p + 1 < end && p[1] == '/')
+            p = SkipToLineEnd(p + 2, end);
+        else if (ch == '/' && p + 1 < end && p[1] == '*')
+            p = SkipBlockComment(p + 2, end);
+        else if (ch == '#' && isLineStart)
+        {
+            p = SkipHorizontalSpaces(p + 1, end);
+
+            const char* directive = p;
+            while (p < end && IsIdentifierChar(*p))
+                p++;
+
+            string_view name(directive, p - directive);
+            if (name == "include")
+            {
+                p = SkipHorizontalSpaces(p, end);
+                if (inactiveNum == 0 && p < end && (*p == '"' || *p == '<'))
+                {
+                    char closing = *p == '"' ? '"' : '>';
+                    const char* includeName = ++p;
+                    while (p < end && *p != closing && *p != '\n')
+                        p++;
+
+                    if (p < end && *p == closing)
+                    {
+                        ScannedInclude& include = includes.emplace_back();
+                        include.name = string(includeName, p - includeName);
+
+                        for (const Conditional& conditional : conditionals)
+                            include.condition = join(include.condition, conditional.active);
+                    }
+                }
+            }
+            else if (name == "define" || name == "undef")
+            {
+                p = SkipHorizontalSpaces(p, end);
+
+                const char* macro = p;
+                while (p < end && IsIdentifierChar(*p))
+                    p++;
+
+                if (inactiveNum == 0 && p != macro)
+                    macros.push_back(string(macro, p - macro));
+            }
+            else if (name == "if" || name == "ifdef" || name == "ifndef")
+            {
+                string text = GetDirectiveText(p, end);
+                if (name == "ifdef")
+                    text = "defined(" + text + ")";
+                else if (name == "ifndef")
+                    text = "!defined(" + text + ")";
+
+                Conditional& conditional = conditionals.emplace_back();
+                conditional.isTaken = false;
+                enterBranch(conditional, text, name == "if" ? getCondition(text) : -1);
+
+                inactiveNum += conditional.isActive ? 0 : 1;
+            }
+            else if ((name == "elif" || name == "else") && !conditionals.empty())
+            {
+                Conditional& conditional = conditionals.back();
+                inactiveNum -= conditional.isActive ? 0 : 1;
+
+                string text = name == "else" ? string() : GetDirectiveText(p, end);
+                enterBranch(conditional, text, name == "else" ? 1 : getCondition(text));
+
+                inactiveNum += conditional.isActive ? 0 : 1;
+            }
+            else if (name == "endif" && !conditionals.empty())
+            {
+                inactiveNum -= conditionals.back().isActive ? 0 : 1;
+                conditionals.pop_back();
+            }
+
+            p = SkipToLineEnd(p, end);
+        }
+        else if (ch == '"' || ch == '\'')
+        {
+            // String or character literal, can't span lines
+            for (p++; p < end && *p != ch && *p != '\n'; p++)
+            {
+                if (*p == '\\' && p + 1 < end)
+                    p++;
+            }
+
+            if (p < end && *p == ch)
+                p++;
+
+            isLineStart = false;
+        }
+        else
+        {
+            // Skip the rest of the token run up to the next character, which can change the state
+            isLineStart = false;
+            for (p++; p < end && *p != '\n' && *p != '/' && *p != '"' && *p != '\''; p++)
+                ;
+        }
+    }
+}
+
+//=====================================================================================================================
+// DEPENDENCY CACHE
+//=====================================================================================================================
+
+#define DEPENDENCY_CACHE_SIGNATURE 0x43444D53 // "SMDC"
+#define DEPENDENCY_CACHE_VERSION 4
+
+void LoadDependencyCache()
+{
+    StateFileReader reader(GetStateFile(".deps"), DEPENDENCY_CACHE_SIGNATURE, DEPENDENCY_CACHE_VERSION);
+
+    uint32_t entryNum = reader.Read<uint32_t>();
+    for (uint32_t i = 0; i < entryNum && reader.IsValid(); i++)
+    {
+        string file = reader.ReadString();
+
+        DependencyCacheEntry entry;
+        entry.time = reader.Read<int64_t>();
+        entry.size = reader.Read<uint64_t>();
+        entry.hash = reader.Read<uint64_t>();
+
+        uint32_t includeNum = reader.Read<uint32_t>();
+        for (uint32_t j = 0; j < includeNum && reader.IsValid(); j++)
+        {
+            ScannedInclude& include = entry.includes.emplace_back();
+            include.name = reader.ReadString();
+            include.condition = reader.ReadString();
+        }
+
+        uint32_t macroNum = reader.Read<uint32_t>();
+        for (uint32_t j = 0; j < macroNum && reader.IsValid(); j++)
+            entry.macros.push_back(reader.ReadString());
+
+        g_DependencyCache[file] = move(entry);
+    }
+
+    if (!reader.IsValid())
+        g_DependencyCache.clear();
+}
+
+void SaveDependencyCache()
+{
+    // Drop files which are not dependencies anymore, otherwise the cache grows forever
+    for (auto it = g_DependencyCache.begin(); it != g_DependencyCache.end();)
+    {
+        if (!it->second.isUsed)
+        {
+            it = g_DependencyCache.erase(it);
+            g_IsDependencyCacheDirty = true;
+        }
+        else
+            it++;
+    }
+
+    if (!g_IsDependencyCacheDirty)
+        return;
+
+    StateFileWriter writer(DEPENDENCY_CACHE_SIGNATURE, DEPENDENCY_CACHE_VERSION);
+
+    writer.Write((uint32_t)g_DependencyCache.size());
+    for (const auto& [file, entry] : g_DependencyCache)
+    {
+        writer.WriteString(file);
+        writer.Write(entry.time);
+        writer.Write(entry.size);
+        writer.Write(entry.hash);
+
+        writer.Write((uint32_t)entry.includes.size());
+        for (const ScannedInclude& include : entry.includes)
+        {
+            writer.WriteString(include.name);
+            writer.WriteString(include.condition);
+        }
+
+        writer.Write((uint32_t)entry.macros.size());
+        for (const string& macro : entry.macros)
+            writer.WriteString(macro);
+    }
+
+    if (!writer.Save(GetStateFile(".deps")))
+        Printf(YELLOW "WARNING: Can't save the dependency cache '%s'!\n", PathToString(GetStateFile(".deps")).c_str());
+
+    g_IsDependencyCacheDirty = false;
+}
+
+// Returns includes, macros and the content hash of a file, reading it only if it has changed since the last run. Thread safe.
+bool GetFileIncludes(const fs::path& file, fs::file_time_type& outTime, DependencyCacheEntry& outEntry)
+{
+    error_code ec;
+    outTime = fs::last_write_time(file, ec);
+    uint64_t size = ec ? 0 : (uint64_t)fs::file_size(file, ec);
+    if (ec)
+        return false;
+
+    int64_t time = (int64_t)outTime.time_since_epoch().count();
+    string key = file.string();
+
+    {
+        lock_guard<mutex> guard(g_DependencyCacheMutex);
+
+        auto found = g_DependencyCache.find(key);
+        if (found != g_DependencyCache.end() && found->second.time == time && found->second.size == size)
+        {
+            found->second.isUsed = true;
+            outEntry = found->second;
+            return true;
+        }
+    }
+
+    MappedFile mappedFile(file);
+    if (!mappedFile.IsOpen())
+        return false;
+
+    outEntry = DependencyCacheEntry();
+    outEntry.time = time;
+    outEntry.size = size;
+    outEntry.hash = Hash(mappedFile.GetData(), mappedFile.GetSize());
+    outEntry.isUsed = true;
+    ScanIncludes(mappedFile.GetData(), mappedFile.GetData() + mappedFile.GetSize(), outEntry.includes, outEntry.macros);
+
+    lock_guard<mutex> guard(g_DependencyCacheMutex);
+
+    g_DependencyCache[key] = outEntry;
+    g_IsDependencyCacheDirty = true;
+
+    return true;
+}
+
+//=====================================================================================================================
+// INCLUDE RESOLVER
+//=====================================================================================================================
+
+// Directory listings turn "does 'dir/name' exist" into a hash lookup instead of a "stat" syscall per include directory
+unordered_map<string, unordered_set<string>> g_DirectoryListings; // key = directory
+unordered_map<string, bool> g_IncludeLookups; // key = "directory\nname", negative results are cached too
+mutex g_IncludeResolverMutex;
+
+inline string ToListingName(string name)
+{
+#ifdef _WIN32
+    // Case-insensitive file system
+    transform(name.begin(), name.end(), name.begin(), [](char c) { return (char)tolower((uint8_t)c); });
+#endif
+
+    return name;
+}
+
+// Thread safe
+bool IsFileInDirectory(const fs::path& dir, const fs::path& name)
+{
+    string key = dir.string() + '\n' + name.string();
+    {
+        lock_guard<mutex> guard(g_IncludeResolverMutex);
+
+        auto found = g_IncludeLookups.find(key);
+        if (found != g_IncludeLookups.end())
+            return found->second;
+    }
+
+    fs::path file = dir / name;
+    string directory = file.parent_path().string();
+
+    // IMPORTANT: a listing never changes once added, so it can be read without the lock
+    const unordered_set<string>* listing = nullptr;
+    {
+        lock_guard<mutex> guard(g_IncludeResolverMutex);
+
+        auto found = g_DirectoryListings.find(directory);
+        if (found != g_DirectoryListings.end())
+            listing = &found->second;
+    }
+
+    if (!listing)
+    {
+        unordered_set<string> names;
+
+        error_code ec;
+        for (fs::directory_iterator it(directory.empty() ? "." : directory, ec), end; !ec && it != end; it.increment(ec))
+            names.insert(ToListingName(it->path().filename().string()));
+
+        lock_guard<mutex> guard(g_IncludeResolverMutex);
+        listing = &g_DirectoryListings.emplace(directory, move(names)).first->second;
+    }
+
+    bool isFound = listing->find(ToListingName(file.filename().string())) != listing->end();
+
+    lock_guard<mutex> guard(g_IncludeResolverMutex);
+    g_IncludeLookups.emplace(key, isFound);
+
+    return isFound;
+}
+
+//=====================================================================================================================
+// CONDITION EVALUATOR
+//=====================================================================================================================
+
+// Macros known to be defined for a group of permutations (global and local defines)
+struct MacroSet
+{
+    unordered_map<string, string> values;
+    unordered_map<string, int32_t> results; // key = condition
+};
+
+vector<MacroSet> g_MacroSets;
+unordered_set<string> g_UnknownMacros; // defined or undefined in scanned files, values depend on the include order
+unordered_set<string> g_PermutationMacros; // defined by global or local defines of at least one permutation
+set<string> g_UnseenMacros; // used in conditions, but defined neither by permutations nor by scanned files
+bool g_IsConditionEvaluationEnabled = true;
+
+// Evaluates a preprocessor expression. Everything, which can't be known before preprocessing (macros defined in
+// files, predefined by the compiler, function-like macros...), is "unknown", and unknown conditions are treated as true.
+// A macro is only known to be undefined if it's defined for other permutations, otherwise it can come from a relaxed
+// include or the compiler
+class ConditionEvaluator
+{
+public:
+    ConditionEvaluator(const MacroSet& macros, uint32_t depth) :
+        m_macros(macros),
+        m_depth(depth)
+    { }
+
+    // Returns 1 if true, 0 if false, -1 if unknown
+    int32_t Evaluate(const string& text)
+    {
+        Value value = EvaluateValue(text);
+        if (!value.isKnown)
+            return -1;
+
+        return value.value != 0 ? 1 : 0;
+    }
+
+private:
+    struct Value
+    {
+        int64_t value;
+        bool isKnown;
+    };
+
+    struct Operator
+    {
+        const char* text;
+        uint32_t precedence;
+    };
+
+    const MacroSet& m_macros;
+    const char* m_p = nullptr;
+    const char* m_end = nullptr;
+    uint32_t m_depth;
+    bool m_isError = false;
+
+    static constexpr Value Unknown = {0, false};
+
+    static bool IsReservedName(const string& name)
+    { return name.size() > 1 && name[0] == '_' && (name[1] == '_' || isupper((uint8_t)name[1])); }
+
+    static bool IsKnownUndefined(const string& name)
+    {
+        if (g_PermutationMacros.find(name) != g_PermutationMacros.end())
+            return true;
+
+        g_UnseenMacros.insert(name);
+
+        return false;
+    }
+
+    Value EvaluateValue(const string& text)
+    {
+        m_p = text.c_str();
+        m_end = m_p + text.size();
+
+        Value value = ParseTernary();
+
+        SkipSpaces();
+        if (m_isError || m_p != m_end)
+            return Unknown;
+
+        return value;
+    }
+
+    void SkipSpaces()
+    {
+        while (m_p < m_end && isspace((uint8_t)*m_p))
+            m_p++;
+    }
+
+    bool Match(char c)
+    {
+        SkipSpaces();
+        if (m_p == m_end || *m_p != c)
+            return false;
+
+        m_p++;
+
+        return true;
+    }
+
+    string ParseIdentifier()
+    {
+        SkipSpaces();
+
+        const char* begin = m_p;
+        while (m_p < m_end && IsIdentifierChar(*m_p))
+            m_p++;
+
+        return string(begin, m_p);
+    }
+
+    // Skips arguments of a function-like macro
+    void SkipArguments()
+    {
+        uint32_t level = 0;
+        do
+        {
+            if (m_p == m_end)
+            {
+                m_isError = true;
+                return;
+            }
+
+            if (*m_p == '(')
+                level++;
+            else if (*m_p == ')')
+                level--;
+
+            m_p++;
+        } while (level);
+    }
+
+    const Operator* PeekOperator()
+    {
+        // IMPORTANT: longer operators first
+        static const Operator operators[] = {
+            {"||", 1}, {"&&", 2}, {"==", 6}, {"!=", 6}, {"<=", 7}, {">=", 7}, {"<<", 8}, {">>", 8},
+            {"|", 3}, {"^", 4}, {"&", 5}, {"<", 7}, {">", 7}, {"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10},
+        };
+
+        SkipSpaces();
+
+        for (const Operator& op : operators)
+        {
+            size_t length = strlen(op.text);
+            if ((size_t)(m_end - m_p) >= length && strncmp(m_p, op.text, length) == 0)
+                return &op;
+        }
+
+        return nullptr;
+    }
+
+    Value ParseTernary()
+    {
+        Value condition = ParseBinary(1);
+        if (!Match('?'))
+            return condition;
+
+        Value a = ParseTernary();
+        if (!Match(':'))
+        {
+            m_isError = true;
+            return Unknown;
+        }
+        Value b = ParseTernary();
+
+        if (condition.isKnown)
+            return condition.value ? a : b;
+
+        if (a.isKnown && b.isKnown && a.value == b.value)
+            return a;
+
+        return Unknown;
+    }
+
+    Value ParseBinary(uint32_t minPrecedence)
+    {
+        Value left = ParseUnary();
+
+        while (!m_isError)
+        {
+            const Operator* op = PeekOperator();
+            if (!op || op->precedence < minPrecedence)
+                break;
+
+            m_p += strlen(op->text);
+
+            Value right = ParseBinary(op->precedence + 1);
+            left = Apply(op->text, left, right);
+        }
+
+        return left;
+    }
+
+    static Value Apply(const string& op, const Value& a, const Value& b)
+    {
+        // Logical operators can be known even if one of the operands is not
+        if (op == "&&")
+        {
+            if ((a.isKnown && !a.value) || (b.isKnown && !b.value))
+                return {0, true};
+
+            return a.isKnown && b.isKnown ? Value{1, true} : Unknown;
+        }
+
+        if (op == "||")
+        {
+            if ((a.isKnown && a.value) || (b.isKnown && b.value))
+                return {1, true};
+
+            return a.isKnown && b.isKnown ? Value{0, true} : Unknown;
+        }
+
+        if (!a.isKnown || !b.isKnown)
+            return Unknown;
+
+        // Unsigned arithmetic avoids undefined behavior on overflow
+        uint64_t x = (uint64_t)a.value;
+        uint64_t y = (uint64_t)b.value;
+
+        if (op == "|") return {(int64_t)(x | y), true};
+        if (op == "^") return {(int64_t)(x ^ y), true};
+        if (op == "&") return {(int64_t)(x & y), true};
+        if (op == "==") return {a.value == b.value, true};
+        if (op == "!=") return {a.value != b.value, true};
+        if (op == "<") return {a.value < b.value, true};
+        if (op == ">") return {a.value > b.value, true};
+        if (op == "<=") return {a.value <= b.value, true};
+        if (op == ">=") return {a.value >= b.value, true};
+        if (op == "<<") return y < 64 ? Value{(int64_t)(x << y), true} : Unknown;
+        if (op == ">>") return y < 64 ? Value{a.value >> y, true} : Unknown;
+        if (op == "+") return {(int64_t)(x + y), true};
+        if (op == "-") return {(int64_t)(x - y), true};
+        if (op == "*") return {(int64_t)(x * y), true};
+
+        // "/" and "%"
+        if (b.value == 0 || (a.value == INT64_MIN && b.value == -1))
+            return Unknown;
+
+        return {op == "/" ? a.value / b.value : a.value % b.value, true};
+    }
+
+    Value ParseUnary()
+    {
+        SkipSpaces();
+        if (m_p == m_end)
+        {
+            m_isError = true;
+            return Unknown;
+        }
+
+        char c = *m_p;
+        if (c == '!' || c == '~' || c == '-' || c == '+')
+        {
+            m_p++;
+
+            Value value = ParseUnary();
+            if (!value.isKnown)
+                return Unknown;
+
+            if (c == '!')
+                return {!value.value, true};
+            if (c == '~')
+                return {~value.value, true};
+            if (c == '-')
+                return {(int64_t)(0 - (uint64_t)value.value), true};
+
+            return value;
+        }
+
+        return ParsePrimary();
+    }
+
+    Value ParsePrimary()
+    {
+        char c = *m_p;
+
+        if (c == '(')
+        {
+            m_p++;
+
+            Value value = ParseTernary();
+            if (!Match(')'))
+                m_isError = true;
+
+            return value;
+        }
+
+        if (isdigit((uint8_t)c))
+        {
+            char* end = nullptr;
+            uint64_t value = strtoull(m_p, &end, 0);
+            m_p = end;
+
+            // Integer suffixes
+            while (m_p < m_end && (*m_p == 'u' || *m_p == 'U' || *m_p == 'l' || *m_p == 'L'))
+                m_p++;
+
+            // Floating point numbers are not allowed
+            if (m_p < m_end && (IsIdentifierChar(*m_p) || *m_p == '.'))
+                m_isError = true;
+
+            return {(int64_t)value, true};
+        }
+
+        if (!IsIdentifierChar(c))
+        {
+            // Character literals and anything unusual
+            m_isError = true;
+            return Unknown;
+        }
+
+        string name = ParseIdentifier();
+
+        if (name == "defined")
+        {
+            bool hasParenthesis = Match('(');
+            string macro = ParseIdentifier();
+            if (macro.empty() || (hasParenthesis && !Match(')')))
+            {
+                m_isError = true;
+                return Unknown;
+            }
+
+            if (g_UnknownMacros.find(macro) != g_UnknownMacros.end() || IsReservedName(macro))
+                return Unknown;
+
+            if (m_macros.values.find(macro) != m_macros.values.end())
+                return {1, true};
+
+            return IsKnownUndefined(macro) ? Value{0, true} : Unknown;
+        }
+
+        SkipSpaces();
+        if (m_p < m_end && *m_p == '(')
+        {
+            SkipArguments();
+            return Unknown;
+        }
+
+        if (g_UnknownMacros.find(name) != g_UnknownMacros.end() || IsReservedName(name) || name == "true" || name == "false")
+            return Unknown;
+
+        auto found = m_macros.values.find(name);
+        if (found == m_macros.values.end())
+            return IsKnownUndefined(name) ? Value{0, true} : Unknown;
+
+        // Self-referencing macros are not expanded again, limit the depth to stay safe
+        if (m_depth >= 16)
+            return Unknown;
+
+        return ConditionEvaluator(m_macros, m_depth + 1).EvaluateValue(found->second);
+    }
+};
+
+// Returns 1 if true, 0 if false, -1 if unknown for the macro set
+int32_t EvaluateIncludeCondition(const string& condition, uint32_t macroSetIndex)
+{
+    if (condition.empty())
+        return 1;
+
+    if (!g_IsConditionEvaluationEnabled)
+        return -1;
+
+    MacroSet& macroSet = g_MacroSets[macroSetIndex];
+
+    auto found = macroSet.results.find(condition);
+    if (found == macroSet.results.end())
+        found = macroSet.results.emplace(condition, ConditionEvaluator(macroSet, 0).Evaluate(condition)).first;
+
+    return found->second;
+}
+
+// Returns "false" only if the condition is known to be false for the macro set
+inline bool IsIncludeActive(const string& condition, uint32_t macroSetIndex)
+{ return EvaluateIncludeCondition(condition, macroSetIndex) != 0; }
+
+//=====================================================================================================================
+// OUTPUT STATUS
+//=====================================================================================================================
+
+// Times of all files in an output directory, gathered in one pass instead of "exists" + "last_write_time" per output
+struct OutputDirectory
+{
+    unordered_map<string, fs::file_time_type> times; // key = file name
+    bool exists = false;
+};
+
+unordered_map<string, OutputDirectory> g_OutputDirectories; // key = directory
+
+#ifndef _WIN32
+
+// Modification time of "stat", macOS names the field differently
+inline const struct timespec& GetStatTime(const struct stat& st)
+{
+#ifdef __APPLE__
+    return st.st_mtimespec;
+#else
+    return st.st_mtim;
+#endif
+}
+
+// The epoch of "fs::file_time_type" is implementation defined, the offset from "stat" times is measured on a real file
+fs::file_time_type FromStatTime(const struct stat& st)
+{
+    static const fs::file_time_type::duration offset = []()
+    {
+        struct stat reference = {};
+        error_code ec;
+        fs::file_time_type referenceTime = fs::last_write_time(g_Options.configFile, ec);
+        if (ec || stat(g_Options.configFile.c_str(), &reference) != 0)
+            return fs::file_time_type::duration::zero();
+
+        const struct timespec& time = GetStatTime(reference);
+        auto statTime = chrono::duration_cast<fs::file_time_type::duration>(chrono::seconds(time.tv_sec) + chrono::nanoseconds(time.tv_nsec));
+
+        return referenceTime.time_since_epoch() - statTime;
+    }();
+
+    const struct timespec& time = GetStatTime(st);
+    auto statTime = chrono::duration_cast<fs::file_time_type::duration>(chrono::seconds(time.tv_sec) + chrono::nanoseconds(time.tv_nsec));
+
+    return fs::file_time_type(statTime + offset);
+}
+
+#endif
+
+const OutputDirectory& GetOutputDirectory(const fs::path& dir)
+{
+    string key = dir.empty() ? "." : dir.string();
+
+    auto found = g_OutputDirectories.find(key);
+    if (found != g_OutputDirectories.end())
+        return found->second;
+
+    OutputDirectory& directory = g_OutputDirectories[key];
+
+#ifdef _WIN32
+    // Directory entries returned by "FindNextFile" already have times
+    error_code ec;
+    fs::directory_iterator it(key, ec);
+    directory.exists = !ec;
+
+    for (fs::directory_iterator end; !ec && it != end; it.increment(ec))
+    {
+        fs::file_time_type time = it->last_write_time(ec);
+        if (!ec)
+            directory.times[ToListingName(it->path().filename().string())] = time;
+    }
+#else
+    DIR* dirStream = opendir(key.c_str());
+    directory.exists = dirStream != nullptr;
+
+    if (dirStream)
+    {
+        int32_t fd = dirfd(dirStream);
+        while (const dirent* entry = readdir(dirStream))
+        {
+            struct stat st;
+            if (fstatat(fd, entry->d_name, &st, 0) == 0)
+                directory.times[entry->d_name] = FromStatTime(st);
+        }
+
+        closedir(dirStream);
+    }
+#endif
+
+    return directory;
+}
+
+// Returns "false" if the output doesn't exist
+bool GetOutputTime(const fs::path& file, fs::file_time_type& outTime)
+{
+    const OutputDirectory& directory = GetOutputDirectory(file.parent_path());
+
+    auto found = directory.times.find(ToListingName(file.filename().string()));
+    if (found == directory.times.end())
+        return false;
+
+    outTime = found->second;
+
+    return true;
+}
+
+// Creates a directory for outputs if needed, returns "true" if it has been created
+bool CreateOutputDirectory(const fs::path& dir)
+{
+    if (dir.empty() || GetOutputDirectory(dir).exists)
+        return false;
+
+    fs::create_directories(dir);
+
+    // Parent directories may be cached as missing too
+    for (fs::path path = dir; !path.empty() && path != path.parent_path(); path = path.parent_path())
+    {
+        auto found = g_OutputDirectories.find(path.string());
+        if (found != g_OutputDirectories.end())
+            g_OutputDirectories.erase(found);
+    }
+
+    return true;
+}
+
+//=====================================================================================================================
+// WATCH
+//=====================================================================================================================
+
+string NormalizePath(const fs::path& path)
+{
+    error_code ec;
+    fs::path absolutePath = fs::absolute(path, ec);
+
+    return (ec ? path : absolutePath).lexically_normal().string();
+}
+
+// Reports changes of watched files. On Linux, "inotify" watches their directories, so files replaced by editors and
+// newly created includes are noticed too. Other platforms poll file times
+class Watcher
+{
+public:
+    Watcher()
     {
-        Printf(RED "ERROR: Compiler not specified!\n");
-        return false;
+#ifdef __linux__
+        m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
     }
 
-    if (!fs::exists(compiler))
+    ~Watcher()
     {
-        Printf(RED "ERROR: Compiler '%s' does not exist!\n", compiler);
-        return false;
+#ifdef __linux__
+        if (m_fd >= 0)
+            close(m_fd);
+#endif
     }
-    
-    if (slang && useAPI)
+
+    bool IsValid() const
     {
-        Printf(RED "ERROR: Use of Slang with --useAPI is not implemented.\n");
-        return false;
+#ifndef __linux__
+        return true;
+#else
+        return m_fd >= 0;
+#endif
     }
 
-    if (strlen(shaderModel) != 3 || strstr(shaderModel, "."))
+    // Forgets watched files, but keeps directory subscriptions
+    void Reset()
     {
-        Printf(RED "ERROR: Shader model ('%s') must have format 'X_Y'!\n", shaderModel);
-        return false;
+        m_files.clear();
+        m_includeNames.clear();
     }
 
-    // Platform
-    uint32_t i = 0;
-    for (; i < PLATFORMS_NUM; i++)
+    void Watch(const fs::path& file)
     {
-        if (!strcmp(platformName, g_PlatformNames[i]))
+        string path = NormalizePath(file);
+
+        error_code ec;
+        fs::file_time_type time = fs::last_write_time(path, ec);
+        if (!m_files.emplace(path, ec ? fs::file_time_type::min() : time).second)
+            return;
+
+#ifdef __linux__
+        string dir = fs::path(path).parent_path().string();
+        if (m_watchedDirectories.insert(dir).second)
         {
-            platform = (Platform)i;
-            break;
+            int32_t wd = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+            if (wd >= 0)
+                m_directories[wd] = dir;
         }
-    }
-    if (i == PLATFORMS_NUM)
-    {
-        Printf(RED "ERROR: Unrecognized platform '%s'!\n", platformName);
-        return false;
+#endif
     }
 
-    if (outputExt)
-        g_OutputExt = outputExt;
-    else
-        g_OutputExt = g_PlatformExts[platform];
+    // A new file with this name can change how includes resolve
+    void WatchIncludeName(const string& name)
+    { m_includeNames.insert(ToListingName(fs::path(name).filename().string())); }
 
-    if (g_Options.vulkanMemoryLayout && platform != SPIRV)
+    // Blocks until something changes, returns "false" if interrupted. "Structural" changes (files created or deleted)
+    // can affect resolution of any include
+    bool Wait(vector<string>& outModifiedFiles, bool& outIsStructural)
     {
-        Printf(RED "ERROR: --vulkanMemoryLayout is only supported for SPIRV target!\n");
-        return false;
-    }
+        outModifiedFiles.clear();
+        outIsStructural = false;
 
-    if (g_Options.vulkanMemoryLayout && 
-        strcmp(g_Options.vulkanMemoryLayout, "dx") != 0 &&
-        strcmp(g_Options.vulkanMemoryLayout, "gl") != 0 && 
-        strcmp(g_Options.vulkanMemoryLayout, "scalar") != 0)
-    {
-        if (g_Options.slang && (strcmp(g_Options.vulkanMemoryLayout, "dx") == 0)) 
+#ifndef __linux__
+        while (!g_IsInterrupted)
         {
-            Printf(RED "ERROR: Unsupported value '%s' for --vulkanMemoryLayout! Only 'gl' and 'scalar' are supported for Slang.\n",
-                g_Options.vulkanMemoryLayout);
+            this_thread::sleep_for(chrono::milliseconds(500));
+
+            for (const auto& [file, time] : m_files)
+            {
+                error_code ec;
+                fs::file_time_type newTime = fs::last_write_time(file, ec);
+                if (ec || newTime != time)
+                {
+                    outModifiedFiles.push_back(file);
+                    outIsStructural |= ec || time == fs::file_time_type::min();
+                }
+            }
+
+            if (!outModifiedFiles.empty())
+                return true;
         }
-        else {
-            Printf(RED "ERROR: Unsupported value '%s' for --vulkanMemoryLayout! Only 'dx', 'gl' and 'scalar' are supported.\n",
-                g_Options.vulkanMemoryLayout);
+#else
+        while (!g_IsInterrupted)
+        {
+            // Wait for a quiet period after the first change, editors and version control touch many files at once
+            pollfd fd = {m_fd, POLLIN, 0};
+            int32_t result = poll(&fd, 1, outModifiedFiles.empty() && !outIsStructural ? 250 : 100);
+
+            if (result > 0)
+                ReadEvents(outModifiedFiles, outIsStructural);
+            else if (result == 0 && (!outModifiedFiles.empty() || outIsStructural))
+                return true;
         }
+#endif
+
         return false;
     }
 
-    if (!g_Options.compilerOptions.empty() && g_Options.useAPI && g_Options.platform == Platform::DXBC)
+private:
+    unordered_map<string, fs::file_time_type> m_files; // key = normalized path
+    unordered_set<string> m_includeNames;
+
+#ifdef __linux__
+    unordered_map<int32_t, string> m_directories; // key = watch descriptor
+    unordered_set<string> m_watchedDirectories;
+    int32_t m_fd = -1;
+
+    void ReadEvents(vector<string>& outModifiedFiles, bool& outIsStructural)
     {
-        Printf(RED "ERROR: --compilerOptions is not compatible with '--platform DXBC --useAPI'!\n");
-        return false;
+        alignas(inotify_event) char buffer[16384];
+
+        while (true)
+        {
+            ssize_t size = read(m_fd, buffer, sizeof(buffer));
+            if (size <= 0)
+                break;
+
+            for (char* p = buffer; p < buffer + size; p += sizeof(inotify_event) + ((inotify_event*)p)->len)
+            {
+                const inotify_event* event = (inotify_event*)p;
+
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    outIsStructural = true;
+                    continue;
+                }
+
+                auto dir = m_directories.find(event->wd);
+                if (dir == m_directories.end() || event->len == 0)
+                    continue;
+
+                string name = event->name;
+                string path = dir->second + '/' + name;
+                bool isWatched = m_files.find(path) != m_files.end();
+
+                // A replaced file is just modified, a new one can be a missing or a shadowing include
+                if (isWatched && (event->mask & (IN_DELETE | IN_MOVED_FROM)))
+                    outIsStructural = true;
+                else if (!isWatched && (event->mask & (IN_CREATE | IN_MOVED_TO)) && m_includeNames.find(name) != m_includeNames.end())
+                    outIsStructural = true;
+                else if (!isWatched)
+                    continue;
+
+                outModifiedFiles.push_back(path);
+            }
+        }
     }
+#endif
+};
 
-    if (g_Options.retryCount < 0)
+//=====================================================================================================================
+// BUILD MANIFEST
+//=====================================================================================================================
+
+#define MANIFEST_SIGNATURE 0x464D4D53 // "SMMF"
+#define MANIFEST_VERSION 3
+
+void LoadManifest()
+{
+    StateFileReader reader(GetStateFile(".manifest"), MANIFEST_SIGNATURE, MANIFEST_VERSION);
+
+    uint32_t entryNum = reader.Read<uint32_t>();
+    for (uint32_t i = 0; i < entryNum && reader.IsValid(); i++)
     {
-        Printf(RED "ERROR: --retryCount must be greater than or equal to 0.\n");
-        return false;
+        string output = reader.ReadString();
+
+        ManifestEntry entry;
+        entry.hash = reader.Read<uint64_t>();
+        entry.optionsHash = reader.Read<uint64_t>();
+
+        uint32_t dependencyNum = reader.Read<uint32_t>();
+        for (uint32_t j = 0; j < dependencyNum && reader.IsValid(); j++)
+            entry.dependencies.push_back(reader.ReadString());
+
+        g_Manifest[output] = move(entry);
     }
 
-    // Absolute path is needed for source files to get "clickable" messages
-#ifdef _WIN32
-    char cd[MAX_PATH];
-    if (!GetCurrentDirectoryA(sizeof(cd), cd))
-#else
-    char cd[PATH_MAX];
-    if (!getcwd(cd, sizeof(cd)))
-#endif
+    if (!reader.IsValid())
+        g_Manifest.clear();
+}
+
+void SaveManifest()
+{
+    // Outputs of permutations removed from the config would stay in the manifest forever
+    unordered_set<string> outputs;
+    for (const Permutation& permutation : g_Permutations)
+        outputs.insert(permutation.taskData.outputFileWithoutExt);
+
+    for (auto it = g_Manifest.begin(); it != g_Manifest.end();)
     {
-        Printf(RED "ERROR: Cannot get the working directory!\n");
-        return false;
+        if (outputs.find(it->first) == outputs.end())
+        {
+            it = g_Manifest.erase(it);
+            g_IsManifestDirty = true;
+        }
+        else
+            it++;
     }
 
-    configFile = fs::path(cd) / fs::path(config);
+    if (!g_IsManifestDirty)
+        return;
 
-    for (fs::path& path : includeDirs)
-        path = configFile.parent_path() / path;
+    StateFileWriter writer(MANIFEST_SIGNATURE, MANIFEST_VERSION);
 
-    return true;
+    writer.Write((uint32_t)g_Manifest.size());
+    for (const auto& [output, entry] : g_Manifest)
+    {
+        writer.WriteString(output);
+        writer.Write(entry.hash);
+        writer.Write(entry.optionsHash);
+
+        writer.Write((uint32_t)entry.dependencies.size());
+        for (const string& dependency : entry.dependencies)
+            writer.WriteString(dependency);
+    }
+
+    if (!writer.Save(GetStateFile(".manifest")))
+        Printf(YELLOW "WARNING: Can't save the build manifest '%s'!\n", PathToString(GetStateFile(".manifest")).c_str());
+
+    g_IsManifestDirty = false;
 }
 
-int AddLocalDefine(struct argparse* self, const struct argparse_option* option)
-{ ((ConfigLine*)(option->data))->defines.push_back(*(const char**)option->value); UNUSED(self); return 0; }
+bool IsUpToDateInManifest(const TaskData& taskData)
+{
+    auto found = g_Manifest.find(taskData.outputFileWithoutExt);
 
-bool ConfigLine::Parse(int32_t argc, const char** argv)
+    return taskData.hash && found != g_Manifest.end() && found->second.hash == taskData.hash;
+}
+
+// Options are compared by fingerprints instead of the config file time, so editing a config line or updating
+// ShaderMake only invalidates affected permutations
+bool AreOptionsUpToDateInManifest(const TaskData& taskData)
 {
-    source = argv[0];
+    auto found = g_Manifest.find(taskData.outputFileWithoutExt);
 
-    const char* unused = nullptr; // storage for the callback
-    struct argparse_option options[] = {
-        OPT_STRING('T', "profile", &profile, "Shader profile", nullptr, 0, 0),
-        OPT_STRING('E', "entryPoint", &entryPoint, "(Optional) entry point", nullptr, 0, 0),
-        OPT_STRING('D', "define", &unused, "(Optional) define(s) in forms 'M=value' or 'M'", AddLocalDefine, (intptr_t)this, 0),
-        OPT_STRING('o', "output", &outputDir, "(Optional) output subdirectory", nullptr, 0, 0),
-        OPT_INTEGER('O', "optimization", &optimizationLevel, "(Optional) optimization level", nullptr, 0, 0),
-        OPT_STRING(0, "outputSuffix", &outputSuffix, "(Optional) Suffix to add before extension after filename", nullptr, 0, 0),
-        OPT_END(),
-    };
+    return found != g_Manifest.end() && found->second.optionsHash == taskData.optionsHash;
+}
 
-    static const char* usages[] = {
-        "path/to/shader -T profile [-E entry -O{0|1|2|3} -o \"output/subdirectory\" --outputSuffix \"suffix\" -D DEF1={0,1} -D DEF2={0,1,2} -D DEF3 ...]",
-        nullptr
-    };
+//=====================================================================================================================
+// TASK HISTORY
+//=====================================================================================================================
 
-    struct argparse argparse;
-    argparse_init(&argparse, options, usages, 0);
-    argparse_describe(&argparse, nullptr, "\nConfiguration options for a shader");
-    argparse_parse(&argparse, argc, argv);
+#define TASK_HISTORY_SIGNATURE 0x48544D53 // "SMTH"
+#define TASK_HISTORY_VERSION 2
 
-    // If there are some non-option elements in the config line, they will remain in the argv array.
-    if (argv[0])
-    {
-        Printf(RED "ERROR: Unrecognized element in the config line: '%s'!\n", argv[0]);
-        return false;
-    }
+void LoadTaskHistory()
+{
+    StateFileReader reader(GetStateFile(".history"), TASK_HISTORY_SIGNATURE, TASK_HISTORY_VERSION);
 
-    if (!profile)
+    uint32_t entryNum = reader.Read<uint32_t>();
+    for (uint32_t i = 0; i < entryNum && reader.IsValid(); i++)
     {
-        Printf(RED "ERROR: Shader target not specified!\n");
-        return false;
+        uint64_t key = reader.Read<uint64_t>();
+
+        TaskHistoryEntry entry;
+        entry.sourceKey = reader.Read<uint64_t>();
+        entry.duration = reader.Read<float>();
+        entry.memory = reader.Read<float>();
+
+        g_TaskHistory[key] = entry;
     }
 
-    return true;
+    if (!reader.IsValid())
+        g_TaskHistory.clear();
 }
 
-//=====================================================================================================================
-// FXC/DXC API
-//=====================================================================================================================
-#ifdef _WIN32
-
-void TokenizeDefineStrings(vector<string>& in, vector<D3D_SHADER_MACRO>& out)
+void SaveTaskHistory()
 {
-    if (in.empty())
+    if (!g_IsTaskHistoryDirty)
         return;
 
-    out.reserve(out.size() + in.size());
-    for (const string& defineString : in)
+    // Permutations removed from the config would stay in the history forever
+    unordered_set<uint64_t> taskKeys;
+    for (const Permutation& permutation : g_Permutations)
+        taskKeys.insert(GetTaskKey(permutation.taskData));
+
+    for (auto it = g_TaskHistory.begin(); it != g_TaskHistory.end();)
     {
-        D3D_SHADER_MACRO& define = out.emplace_back();
-        char* s = (char*)defineString.c_str(); // IMPORTANT: "defineString" gets split into tokens divided by '\0'
-        define.Name = strtok(s, "=");
-        define.Definition = strtok(nullptr, "=");
+        if (taskKeys.find(it->first) == taskKeys.end())
+            it = g_TaskHistory.erase(it);
+        else
+            it++;
+    }
+
+    StateFileWriter writer(TASK_HISTORY_SIGNATURE, TASK_HISTORY_VERSION);
+
+    writer.Write((uint32_t)g_TaskHistory.size());
+    for (const auto& [key, entry] : g_TaskHistory)
+    {
+        writer.Write(key);
+        writer.Write(entry.sourceKey);
+        writer.Write(entry.duration);
+        writer.Write(entry.memory);
     }
+
+    if (!writer.Save(GetStateFile(".history")))
+        Printf(YELLOW "WARNING: Can't save the task history '%s'!\n", PathToString(GetStateFile(".history")).c_str());
+
+    g_IsTaskHistoryDirty = false;
 }
 
-// Parses a string with command line options into a vector of wstring, one wstring per option.
-// Options are separated by spaces and may be quoted with "double quotes".
-// Backslash (\) means the next character is inserted literally into the output.
-void TokenizeCompilerOptions(const char* in, vector<wstring>& out)
+// Estimates compile durations and peak memory from the history. Unseen tasks are estimated by other permutations of
+// the same shader, or by all known tasks: by the average duration and by the maximal memory
+class TaskEstimator
 {
-    wstring current;
-    bool quotes = false;
-    bool escape = false;
-    const char* ptr = in;
-    while (char ch = *ptr++)
+public:
+    TaskEstimator()
     {
-        if (escape)
+        for (const auto& [key, entry] : g_TaskHistory)
         {
-            current.push_back(wchar_t(ch));
-            escape = false;
-            continue;
+            m_sources[entry.sourceKey].Add(entry);
+            m_total.Add(entry);
         }
+    }
 
-        if (ch == ' ' && !quotes)
-        {
-            if (!current.empty())
-                out.push_back(current);
-            current.clear();
-        }
-        else if (ch == '\\')
-        {
-            escape = true;
-        }
-        else if (ch == '"')
+    bool IsValid() const
+    { return m_total.num != 0; }
+
+    float EstimateDuration(const TaskData& taskData) const
+    {
+        auto found = g_TaskHistory.find(GetTaskKey(taskData));
+        if (found != g_TaskHistory.end())
+            return found->second.duration;
+
+        auto source = m_sources.find(Hash(taskData.source));
+        if (source != m_sources.end())
+            return source->second.GetDuration();
+
+        return m_total.GetDuration();
+    }
+
+    // MB, 0 if unknown
+    float EstimateMemory(const TaskData& taskData) const
+    {
+        auto found = g_TaskHistory.find(GetTaskKey(taskData));
+        if (found != g_TaskHistory.end() && found->second.memory != 0.0f)
+            return found->second.memory;
+
+        auto source = m_sources.find(Hash(taskData.source));
+        if (source != m_sources.end() && source->second.maxMemory != 0.0f)
+            return source->second.maxMemory;
+
+        return m_total.maxMemory;
+    }
+
+private:
+    struct Statistics
+    {
+        double durationSum = 0.0;
+        float maxMemory = 0.0f;
+        uint32_t num = 0;
+
+        void Add(const TaskHistoryEntry& entry)
         {
-            quotes = !quotes;
+            durationSum += entry.duration;
+            maxMemory = max(maxMemory, entry.memory);
+            num++;
         }
+
+        float GetDuration() const
+        { return num ? float(durationSum / num) : 0.0f; }
+    };
+
+    unordered_map<uint64_t, Statistics> m_sources;
+    Statistics m_total;
+};
+
+// Longest tasks go first to shorten the critical path (tasks are taken from the end)
+void SortTasksByDuration()
+{
+    TaskEstimator estimator;
+    if (!estimator.IsValid())
+        return;
+
+    vector<pair<float, uint32_t>> order(g_TaskData.size());
+    for (size_t i = 0; i < g_TaskData.size(); i++)
+        order[i] = {estimator.EstimateDuration(g_TaskData[i]), (uint32_t)i};
+
+    stable_sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    vector<TaskData> tasks;
+    tasks.reserve(g_TaskData.size());
+    for (const auto& [duration, index] : order)
+        tasks.push_back(move(g_TaskData[index]));
+
+    g_TaskData = move(tasks);
+}
+
+// Without any history a task gets an equal share of the budget
+void EstimateTaskMemory(uint32_t threadsNum)
+{
+    TaskEstimator estimator;
+    uint64_t fallback = g_MemoryBudget.GetBudget() / threadsNum;
+
+    for (TaskData& taskData : g_TaskData)
+    {
+        float memory = estimator.EstimateMemory(taskData);
+        taskData.memoryEstimate = memory != 0.0f ? uint64_t(memory * 1024.0 * 1024.0) : fallback;
+    }
+}
+
+//=====================================================================================================================
+// MAIN
+//=====================================================================================================================
+
+struct ResolvedInclude
+{
+    fs::path file; // include name if not found
+    string condition;
+    bool isFound;
+};
+
+struct DependencyNode
+{
+    vector<ResolvedInclude> includes;
+    vector<string> macros;
+    fs::file_time_type time;
+    uint64_t hash = 0;
+    bool isOpened = false;
+};
+
+unordered_map<string, DependencyNode> g_DependencyGraph;
+unordered_map<string, uint64_t> g_HierarchicalHashes; // key = "macroSetIndex|file"
+
+void ScanDependencyNode(const fs::path& file, DependencyNode& node)
+{
+    DependencyCacheEntry entry;
+    node.isOpened = GetFileIncludes(file, node.time, entry);
+    node.hash = entry.hash;
+    node.macros = move(entry.macros);
+
+    // All includes are resolved, since a missing one can be excluded by defines of some permutations
+    fs::path path = file.parent_path();
+    for (const ScannedInclude& include : entry.includes)
+    {
+        fs::path includeName = include.name;
+        if (find(g_Options.relaxedIncludes.begin(), g_Options.relaxedIncludes.end(), includeName) != g_Options.relaxedIncludes.end())
+            continue;
+
+        bool isFound = false;
+        fs::path includeFile = path / includeName;
+        if (IsFileInDirectory(path, includeName))
+            isFound = true;
         else
         {
-            current.push_back(wchar_t(ch));
+            for (const fs::path& includePath : g_Options.includeDirs)
+            {
+                includeFile = includePath / includeName;
+                if (IsFileInDirectory(includePath, includeName))
+                {
+                    isFound = true;
+                    break;
+                }
+            }
         }
-    }
 
-    if (!current.empty())
-        out.push_back(current);
+        node.includes.push_back({isFound ? includeFile : includeName, include.condition, isFound});
+    }
 }
 
-class FxcIncluder : public ID3DInclude
+// Fills the dependency graph for the given files and everything they include, using multiple threads
+void ScanDependencies(const vector<fs::path>& files, uint32_t threadsNum)
 {
-public:
-    FxcIncluder(const fs::path& sourceFile)
-    {
-        includeDirs.reserve(g_Options.includeDirs.size() + 8);
+    mutex graphMutex;
+    condition_variable condition;
+    vector<fs::path> queue;
+    uint32_t busyNum = 0;
 
-        includeDirs.push_back(sourceFile.parent_path());
-        for (const fs::path& path : g_Options.includeDirs)
-            includeDirs.push_back(path);
+    for (const fs::path& file : files)
+    {
+        if (g_DependencyGraph.try_emplace(file.string()).second)
+            queue.push_back(file);
     }
 
-    ~FxcIncluder()
-    {}
-
-    STDMETHOD(Open)(THIS_ D3D_INCLUDE_TYPE includeType, LPCSTR pFileName, LPCVOID pParentData, LPCVOID *ppData, UINT *pBytes)
+    auto worker = [&]()
     {
-        // TODO: an error in an include file gets reported using relative path with recent WinSDKs, what makes it 
-        // "unclickable" from the Visual Studio output window. It doesn't look like an issue of "FxcIncluder",
-        // because the issue is here even with "D3D_COMPILE_STANDARD_FILE_INCLUDE", but "FXC.exe" works fine.
+        unique_lock<mutex> lock(graphMutex);
+        while (true)
+        {
+            condition.wait(lock, [&]() { return !queue.empty() || busyNum == 0; });
+            if (queue.empty())
+                return;
 
-        UNUSED(includeType);
-        UNUSED(pParentData);
+            fs::path file = move(queue.back());
+            queue.pop_back();
+            busyNum++;
 
-        *ppData = 0;
-        *pBytes = 0;
+            // IMPORTANT: references to elements remain valid when other threads insert into the graph
+            DependencyNode& node = g_DependencyGraph[file.string()];
 
-        // Find file
-        fs::path name = fs::path(pFileName);
-        fs::path file = name;
-        if (file.is_relative())
-        {
-            for (const fs::path& path : includeDirs)
+            lock.unlock();
+            ScanDependencyNode(file, node);
+            lock.lock();
+
+            for (const ResolvedInclude& include : node.includes)
             {
-                file = path / name;
-                if (fs::exists(file))
-                    break;
+                if (include.isFound && g_DependencyGraph.try_emplace(include.file.string()).second)
+                    queue.push_back(include.file);
             }
+
+            busyNum--;
+            condition.notify_all();
         }
+    };
 
-        // Open file
-        FILE* stream = fopen(file.string().c_str(), "rb");
-        if (!stream)
-            return E_FAIL;
+    vector<thread> threads(threadsNum - 1);
+    for (thread& t : threads)
+        t = thread(worker);
 
-        // Load file
-        uint32_t len = GetFileLength(stream);
-        char* buf = (char*)malloc(len);
-        if (!buf)
-            return E_FAIL;
+    worker();
 
-        fread(buf, 1, len, stream);
-        fclose(stream);
+    for (thread& t : threads)
+        t.join();
+}
 
-        *ppData = buf;
-        *pBytes = len;
+// Walks the scanned dependency graph, skipping includes excluded by the macro set and reporting errors exactly like
+// a serial scan would
+bool GetHierarchicalUpdateTime(const fs::path& file, uint32_t macroSetIndex, list<fs::path>& callStack, fs::file_time_type& outTime)
+{
+    static uint32_t cycleNum = 0;
 
-        // Add the path to this file to the current include stack so that any sub-includes would be relative to this path
-        includeDirs.push_back(file.parent_path());
+    string key = to_string(macroSetIndex) + '|' + file.string();
+    auto found = g_HierarchicalUpdateTimes.find(key);
+    if (found != g_HierarchicalUpdateTimes.end())
+    {
+        outTime = found->second;
 
-        return S_OK;
+        return true;
     }
 
-    STDMETHOD(Close)(THIS_ LPCVOID pData)
+    auto node = g_DependencyGraph.find(file.string());
+    if (node == g_DependencyGraph.end() || !node->second.isOpened)
     {
-        if (pData)
+        Printf(RED "ERROR: Can't open file '%s', included in:\n", PathToString(file).c_str());
+        for (const fs::path& otherFile : callStack)
+            Printf(RED "\t%s\n", PathToString(otherFile).c_str());
+
+        return false;
+    }
+
+    // Break include cycles, the file is already accounted for by the caller
+    if (find(callStack.begin(), callStack.end(), file) != callStack.end())
+    {
+        outTime = node->second.time;
+        cycleNum++;
+
+        return true;
+    }
+
+    callStack.push_front(file);
+
+    uint32_t prevCycleNum = cycleNum;
+    fs::file_time_type hierarchicalUpdateTime = node->second.time;
+
+    for (const ResolvedInclude& include : node->second.includes)
+    {
+        int32_t isActive = EvaluateIncludeCondition(include.condition, macroSetIndex);
+        if (!isActive)
+            continue;
+
+        // The condition is likely false, the compiler reports the include if it's not
+        if (!include.isFound && isActive < 0)
+            continue;
+
+        if (!include.isFound)
         {
-            // Pop the path for the innermost included file from the include stack
-            includeDirs.pop_back();
+            Printf(RED "ERROR: Can't find include file '%s', included in:\n", PathToString(include.file).c_str());
+            for (const fs::path& otherFile : callStack)
+                Printf(RED "\t%s\n", PathToString(otherFile).c_str());
 
-            // Release the data
-            free((void*)pData);
+            return false;
         }
 
-        return S_OK;
+        fs::file_time_type dependencyTime;
+        if (!GetHierarchicalUpdateTime(include.file, macroSetIndex, callStack, dependencyTime))
+            return false;
+
+        hierarchicalUpdateTime = max(dependencyTime, hierarchicalUpdateTime);
     }
 
-private:
-    vector<fs::path> includeDirs;
-};
+    callStack.pop_front();
 
-void FxcCompile()
-{
-    static const uint32_t optimizationLevelRemap[] = {
-        D3DCOMPILE_SKIP_OPTIMIZATION,
-        D3DCOMPILE_OPTIMIZATION_LEVEL1,
-        D3DCOMPILE_OPTIMIZATION_LEVEL2,
-        D3DCOMPILE_OPTIMIZATION_LEVEL3,
-    };
+    // A file inside of an include cycle doesn't see the whole cycle, so its time can't be reused
+    if (cycleNum == prevCycleNum || callStack.empty())
+        g_HierarchicalUpdateTimes[key] = hierarchicalUpdateTime;
 
-    vector<D3D_SHADER_MACRO> optionsDefines;
-    vector<string> tokenizedDefines = g_Options.defines;
-    TokenizeDefineStrings(tokenizedDefines, optionsDefines);
+    outTime = hierarchicalUpdateTime;
 
-    while (!g_Terminate)
+    return true;
+}
+
+// Hashes paths and contents of a file and everything it includes (as a Merkle tree), fails silently if something is missing
+bool GetHierarchicalHash(const fs::path& file, uint32_t macroSetIndex, vector<string>& callStack, uint64_t& outHash)
+{
+    static uint32_t cycleNum = 0;
+
+    string key = file.string();
+    string memoKey = to_string(macroSetIndex) + '|' + key;
+    auto found = g_HierarchicalHashes.find(memoKey);
+    if (found != g_HierarchicalHashes.end())
     {
-        // Getting a task in the current thread
-        TaskData taskData;
-        {
-            lock_guard<mutex> guard(g_TaskMutex);
-            if (g_TaskData.empty())
-                return;
+        outHash = found->second;
 
-            taskData = g_TaskData.back();
-            g_TaskData.pop_back();
-        }
+        return outHash != 0;
+    }
 
-        // Tokenize DXBC defines
-        vector<D3D_SHADER_MACRO> defines = optionsDefines;
-        TokenizeDefineStrings(taskData.defines, defines);
-        defines.push_back({nullptr, nullptr});
+    auto node = g_DependencyGraph.find(key);
+    if (node == g_DependencyGraph.end() || !node->second.isOpened)
+        return false;
 
-        // Args
-        uint32_t compilerFlags = (g_Options.pdb ? (D3DCOMPILE_DEBUG | D3DCOMPILE_DEBUG_NAME_FOR_BINARY) : 0) |
-            (g_Options.allResourcesBound ? D3DCOMPILE_ALL_RESOURCES_BOUND : 0) |
-            (g_Options.warningsAreErrors ? D3DCOMPILE_WARNINGS_ARE_ERRORS : 0) |
-            (g_Options.matrixRowMajor ? D3DCOMPILE_PACK_MATRIX_ROW_MAJOR : 0) |
-            optimizationLevelRemap[taskData.optimizationLevel];
+    uint64_t hash = Hash(key, node->second.hash);
 
-        // Compiling the shader
-        fs::path sourceFile = g_Options.configFile.parent_path() / g_Options.sourceDir / taskData.source;
+    // Break include cycles, the file is already accounted for by the caller
+    if (find(callStack.begin(), callStack.end(), key) != callStack.end())
+    {
+        outHash = hash;
+        cycleNum++;
 
-        FxcIncluder fxcIncluder(sourceFile);
-        string profile = taskData.profile + "_5_0";
+        return true;
+    }
 
-        ComPtr<ID3DBlob> codeBlob;
-        ComPtr<ID3DBlob> errorBlob;
-        HRESULT hr = D3DCompileFromFile(
-            sourceFile.wstring().c_str(),
-            defines.data(),
-            &fxcIncluder,
-            taskData.entryPoint.c_str(),
-            profile.c_str(),
-            compilerFlags, 0,
-            &codeBlob,
-            &errorBlob);
+    callStack.push_back(key);
 
-        bool isSucceeded = SUCCEEDED(hr) && codeBlob;
+    uint32_t prevCycleNum = cycleNum;
+    bool isComplete = true;
 
-        if (g_Terminate)
-            break;
+    for (const ResolvedInclude& include : node->second.includes)
+    {
+        int32_t isActive = EvaluateIncludeCondition(include.condition, macroSetIndex);
+        if (!isActive || (!include.isFound && isActive < 0))
+            continue;
 
-        // Dump PDB
-        if (isSucceeded && g_Options.pdb)
+        uint64_t includeHash;
+        if (!include.isFound || !GetHierarchicalHash(include.file, macroSetIndex, callStack, includeHash))
         {
-            // Retrieve the debug info part of the shader
-            ComPtr<ID3DBlob> pdb;
-            D3DGetBlobPart(codeBlob->GetBufferPointer(), codeBlob->GetBufferSize(), D3D_BLOB_PDB, 0, &pdb);
+            isComplete = false;
+            break;
+        }
 
-            // Retrieve the suggested name for the debug data file
-            ComPtr<ID3DBlob> pdbName;
-            D3DGetBlobPart(codeBlob->GetBufferPointer(), codeBlob->GetBufferSize(), D3D_BLOB_DEBUG_NAME, 0, &pdbName);
+        hash = Hash(includeHash, hash);
+    }
 
-            // This struct represents the first four bytes of the name blob
-            struct ShaderDebugName
-            {
-                uint16_t Flags;       // Reserved, must be set to zero
-                uint16_t NameLength;  // Length of the debug name, without null terminator
-                                      // Followed by NameLength bytes of the UTF-8-encoded name
-                                      // Followed by a null terminator
-                                      // Followed by [0-3] zero bytes to align to a 4-byte boundary
-            };
+    callStack.pop_back();
 
-            auto pDebugNameData = (const ShaderDebugName*)(pdbName->GetBufferPointer());
-            auto pName = (const char*)(pDebugNameData + 1);
+    if (!isComplete)
+        hash = 0;
 
-            string file = fs::path(taskData.outputFileWithoutExt).parent_path().string() + "/" + PDB_DIR + "/" + pName;
-            FILE* fp = fopen(file.c_str(), "wb");
-            if (fp)
-            {
-                fwrite(pdb->GetBufferPointer(), pdb->GetBufferSize(), 1, fp);
-                fclose(fp);
-            }
-        }
+    if (cycleNum == prevCycleNum || callStack.empty())
+        g_HierarchicalHashes[memoKey] = hash;
 
-        // Strip reflection
-        ComPtr<ID3DBlob> strippedBlob;
-        if (g_Options.stripReflection && isSucceeded)
+    outHash = hash;
+
+    return isComplete;
+}
+
+// Bump if changes in ShaderMake affect compiled outputs, to rebuild them after an update
+#define OUTPUT_FORMAT_VERSION 1
+
+uint64_t g_GlobalOptionsHash = 0; // computed once per build, so watching picks up an updated compiler
+
+// Hashes everything affecting the compiled code of a permutation, except its dependencies
+uint64_t GetOptionsHash(const TaskData& taskData)
+{
+    if (!g_GlobalOptionsHash)
+    {
+        uint64_t hash = Hash((uint64_t)OUTPUT_FORMAT_VERSION);
+        hash = Hash((uint64_t)g_Options.platform, hash);
+        hash = Hash(string(g_Options.compiler), hash);
+        hash = Hash(string(g_Options.shaderModel), hash);
+
+        // The compiler itself, an update must rebuild everything
+        fs::path compiler = FindExecutable(g_Options.compiler);
+
+        error_code ec;
+        uint64_t compilerSize = (uint64_t)fs::file_size(compiler, ec);
+        fs::file_time_type compilerTime;
+        if (!ec)
+            compilerTime = fs::last_write_time(compiler, ec);
+
+        if (ec)
+            Printf(YELLOW "WARNING: Can't fingerprint the compiler '%s': %s. Updating it won't rebuild shaders!\n", PathToString(compiler).c_str(), ec.message().c_str());
+        else
         {
-            D3DStripShader(codeBlob->GetBufferPointer(), codeBlob->GetBufferSize(), D3DCOMPILER_STRIP_REFLECTION_DATA | D3DCOMPILER_STRIP_DEBUG_INFO, &strippedBlob);
-            codeBlob = strippedBlob;
+            hash = Hash(compilerSize, hash);
+            hash = Hash((uint64_t)compilerTime.time_since_epoch().count(), hash);
         }
+        hash = Hash(string(g_Options.vulkanVersion), hash);
+        hash = Hash(string(g_Options.vulkanMemoryLayout ? g_Options.vulkanMemoryLayout : ""), hash);
+
+        for (const fs::path& includeDir : g_Options.includeDirs)
+            hash = Hash(includeDir.string(), hash);
+        for (const string& define : g_Options.defines)
+            hash = Hash(define, hash);
+        for (const string& extension : g_Options.spirvExtensions)
+            hash = Hash(extension, hash);
+        for (const string& compilerOption : g_Options.compilerOptions)
+            hash = Hash(compilerOption, hash);
+
+        uint32_t regShifts[] = {g_Options.sRegShift, g_Options.tRegShift, g_Options.bRegShift, g_Options.uRegShift};
+        hash = Hash(regShifts, sizeof(regShifts), hash);
+
+        bool flags[] = {g_Options.warningsAreErrors, g_Options.allResourcesBound, g_Options.pdb, g_Options.embedPdb, g_Options.stripReflection,
+            g_Options.matrixRowMajor, g_Options.hlsl2021, g_Options.useAPI, g_Options.slang, g_Options.slangHlsl, g_Options.noRegShifts};
+        hash = Hash(flags, sizeof(flags), hash);
+
+        g_GlobalOptionsHash = hash;
+    }
+
+    uint64_t hash = Hash(taskData.source, g_GlobalOptionsHash);
+    hash = Hash(taskData.entryPoint, hash);
+    hash = Hash(taskData.profile, hash);
+    hash = Hash((uint64_t)taskData.optimizationLevel, hash);
+    for (const string& define : taskData.defines)
+        hash = Hash(define, hash);
+
+    // The full command line covers everything, which reaches the compiler, including output kinds. The compiler itself
+    // is fingerprinted above
+    if (!g_Options.useAPI)
+    {
+        CompilerCommand cmd;
+        GetCompilerCommand(taskData, taskData.outputFileWithoutExt + g_OutputExt, string(), cmd);
+        hash = Hash(cmd.ToString(1), hash);
+    }
+
+    return hash;
+}
+
+bool ProcessConfigLine(uint32_t lineIndex, const string& line)
+{
+    // Tokenize
+    string lineCopy = line;
+    vector<const char*> tokens;
+    TokenizeConfigLine((char*)lineCopy.c_str(), tokens);
+
+    // Parse config line
+    ConfigLine configLine;
+    if (!configLine.Parse((int32_t)tokens.size(), tokens.data()))
+    {
+        Printf(RED "%s(%u,0): ERROR: Can't parse config line!\n", PathToString(g_Options.configFile).c_str(), lineIndex + 1);
+
+        return false;
+    }
+
+    // DXBC: skip unsupported profiles
+    string profile = configLine.profile;
+    if (g_Options.platform == DXBC && (profile == "lib" || profile == "ms" || profile == "as"))
+        return true;
+
+    // Concatenate define strings, i.e. to get something, like: "A=1 B=0 C"
+    string combinedDefines = "";
+    for (size_t i = 0; i < configLine.defines.size(); i++)
+    {
+        combinedDefines += configLine.defines[i];
+        if (i != configLine.defines.size() - 1 )
+            combinedDefines += " ";
+    }
+
+    // Compiled shader name
+    fs::path shaderName = RemoveLeadingDotDots(configLine.source);
+    shaderName.replace_extension("");
+    if (g_Options.flatten || configLine.outputDir) // Specifying -o <path> for a shader removes the original path
+        shaderName = shaderName.filename();
+    if (strcmp(configLine.entryPoint, "main"))
+        shaderName += "_" + string(configLine.entryPoint);
+    if(configLine.outputSuffix)
+        shaderName += string(configLine.outputSuffix);
 
-        // Dump output
-        if (isSucceeded)
-            DumpShader(taskData, (uint8_t*)codeBlob->GetBufferPointer(), codeBlob->GetBufferSize());
+    // Compiled permutation name
+    fs::path permutationName = shaderName;
+    if (!configLine.defines.empty())
+    {
+        uint32_t permutationHash = HashToUint(hash<string>()(combinedDefines));
 
-        // Update progress
-        UpdateProgress(taskData, isSucceeded, false, errorBlob ? (char*)errorBlob->GetBufferPointer() : nullptr);
+        char buf[16];
+        snprintf(buf, sizeof(buf), "_%08X", permutationHash);
 
-        // Terminate if this shader failed and "--continue" is not set
-        if (g_Terminate)
-            break;
+        permutationName += buf;
     }
-}
 
-void DxcCompile()
-{
-    static const wchar_t* optimizationLevelRemap[] = {
-        // Note: if you're getting errors like "error C2065: 'DXC_ARG_SKIP_OPTIMIZATIONS': undeclared identifier" here,
-        // please update the Windows SDK to at least version 10.0.20348.0.
-        DXC_ARG_SKIP_OPTIMIZATIONS,
-        DXC_ARG_OPTIMIZATION_LEVEL1,
-        DXC_ARG_OPTIMIZATION_LEVEL2,
-        DXC_ARG_OPTIMIZATION_LEVEL3,
-    };
+    // Output directory
+    fs::path outputDir = g_Options.outputDir;
+    if (configLine.outputDir)
+        outputDir /= configLine.outputDir;
 
-    // Gather SPIRV register shifts once
-    static const wchar_t* regShiftArgs[] = {
-        L"-fvk-s-shift",
-        L"-fvk-t-shift",
-        L"-fvk-b-shift",
-        L"-fvk-u-shift",
-    };
+    // Create intermediate output directories
+    bool force = g_Options.force;
+    string reason = force ? "forced" : "";
+    string reasonDetail;
 
-    vector<wstring> regShifts;
-    if (!g_Options.noRegShifts)
+    auto forceRebuild = [&](const char* newReason, const fs::path& file)
     {
-        for (uint32_t reg = 0; reg < 4; reg++)
+        if (!force)
         {
-            for (uint32_t space = 0; space < SPIRV_SPACES_NUM; space++)
-            {
-                wchar_t buf[64];
+            reason = newReason;
+            reasonDetail = PathToString(file);
+        }
 
-                regShifts.push_back(regShiftArgs[reg]);
+        force = true;
+    };
 
-                swprintf(buf, COUNT_OF(buf), L"%u", (&g_Options.sRegShift)[reg]);
-                regShifts.push_back(wstring(buf));
+    fs::path endPath = outputDir / shaderName.parent_path();
+    if (g_Options.pdb)
+        endPath /= PDB_DIR;
+    if (CreateOutputDirectory(endPath))
+        forceRebuild("new-directory", endPath);
 
-                swprintf(buf, COUNT_OF(buf), L"%u", space);
-                regShifts.push_back(wstring(buf));
-            }
-        }
+    // Gather registry entries and typed permutations for all permutations, including the up-to-date ones
+    string relativeShaderName = (fs::path(configLine.outputDir ? configLine.outputDir : "") / shaderName).generic_string();
+    if (g_Options.registry)
+    {
+        RegistryEntry& entry = g_RegistryEntries.emplace_back();
+        entry.shaderName = relativeShaderName;
+        entry.combinedDefines = combinedDefines;
+        entry.permutationFileWithoutExt = PathToString(outputDir / permutationName);
     }
 
-    // TODO: is a global instance thread safe?
-    ComPtr<IDxcCompiler3> dxcCompiler;
-    HRESULT hr = DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(&dxcCompiler));
-    if (FAILED(hr))
+    if (g_Options.typedPermutations && !configLine.defines.empty())
     {
-        // Print a message explaining that we cannot compile anything.
-        // This can happen when the user specifies a DXC version that is too old.
-        lock_guard<mutex> guard(g_TaskMutex);
-        static bool once = true;
-        if (once)
-        {
-            Printf(RED "ERROR: Cannot create an instance of IDxcCompiler3, HRESULT = 0x%08x (%s)\n", hr, std::system_category().message(hr).c_str());
-            once = false;
-        }
-        g_Terminate = true;
-        return;
+        ShaderPermutations& permutations = g_ShaderPermutations[relativeShaderName];
+        permutations.headerFile = outputDir / shaderName;
+        permutations.headerFile += ".permutations.h";
+        permutations.defines.push_back(configLine.defines);
     }
 
-    ComPtr<IDxcUtils> dxcUtils;
-    hr = DxcCreateInstance(CLSID_DxcUtils, IID_PPV_ARGS(&dxcUtils));
-    if (FAILED(hr))
+    // Early out if no changes detected
+    fs::file_time_type zero; // constructor sets to 0
+    fs::file_time_type outputTime = zero;
+
+    auto checkOutput = [&](const fs::path& outputFile)
     {
-        // Also print an error message.
-        // Not sure if this ever happens or all such cases are handled by the condition above, but let's be safe.
-        lock_guard<mutex> guard(g_TaskMutex);
-        static bool once = true;
-        if (once)
+        if (g_Options.depfile)
+            g_OutputFiles.insert(fs::absolute(outputFile).lexically_normal().generic_string());
+
+        fs::file_time_type time;
+        if (!GetOutputTime(outputFile, time))
+            forceRebuild("missing-output", outputFile);
+
+        if (!force)
         {
-            Printf(RED "ERROR: Cannot create an instance of IDxcUtils, HRESULT = 0x%08x (%s)\n", hr, std::system_category().message(hr).c_str());
-            once = false;
+            if (outputTime == zero)
+                outputTime = time;
+            else
+                outputTime = min(outputTime, time);
         }
-        g_Terminate = true;
-        return;
-    }
+    };
 
-    while (!g_Terminate)
     {
-        // Getting a task in the current thread
-        TaskData taskData;
-        {
-            lock_guard<mutex> guard(g_TaskMutex);
-            if (g_TaskData.empty())
-                return;
+        fs::path outputFile = outputDir / permutationName;
 
-            taskData = g_TaskData.back();
-            g_TaskData.pop_back();
-        }
+        outputFile += g_OutputExt;
+        if (g_Options.binary)
+            checkOutput(outputFile);
 
-        // Compiling the shader
-        fs::path sourceFile = g_Options.configFile.parent_path() / g_Options.sourceDir / taskData.source;
-        wstring wsourceFile = sourceFile.wstring();
+        if (g_Options.binary && g_Options.assembly)
+            checkOutput(fs::path(outputFile) += ".S");
 
-        ComPtr<IDxcBlob> codeBlob;
-        ComPtr<IDxcBlobEncoding> errorBlob;
-        bool isSucceeded = false;
+        outputFile += ".h";
+        if (g_Options.header)
+            checkOutput(outputFile);
+    }
 
-        ComPtr<IDxcBlobEncoding> sourceBlob;
-        hr = dxcUtils->LoadFile(wsourceFile.c_str(), nullptr, &sourceBlob);
+    {
+        fs::path outputFile = outputDir / shaderName;
 
-        if (SUCCEEDED(hr))
-        {
-            vector<wstring> args;
-            args.reserve(16 + (g_Options.defines.size() + taskData.defines.size() + g_Options.includeDirs.size()) * 2
-                + (g_Options.platform == SPIRV ? regShifts.size() + g_Options.spirvExtensions.size() : 0));
+        outputFile += g_OutputExt;
+        if (g_Options.binaryBlob)
+            checkOutput(outputFile);
 
-            // Source file
-            args.push_back(wsourceFile);
+        if (g_Options.binaryBlob && g_Options.assembly)
+            checkOutput(fs::path(outputFile) += ".S");
 
-            // Profile
-            args.push_back(L"-T");
-            args.push_back(AnsiToWide(taskData.profile + "_" + g_Options.shaderModel));
+        outputFile += ".h";
+        if (g_Options.headerBlob)
+            checkOutput(outputFile);
+    }
 
-            // Entry point
-            args.push_back(L"-E");
-            args.push_back(AnsiToWide(taskData.entryPoint));
+    // Prepare a permutation, which becomes a task if it's out of date
+    uint32_t optimizationLevel = configLine.optimizationLevel == USE_GLOBAL_OPTIMIZATION_LEVEL ? g_Options.optimizationLevel : configLine.optimizationLevel;
+    optimizationLevel = min(optimizationLevel, 3u);
 
-            // Defines
-            for (const string& define : g_Options.defines)
-            {
-                args.push_back(L"-D");
-                args.push_back(AnsiToWide(define));
-            }
-            for (const string& define : taskData.defines)
-            {
-                args.push_back(L"-D");
-                args.push_back(AnsiToWide(define));
-            }
+    Permutation& permutation = g_Permutations.emplace_back();
+    permutation.sourceFile = g_Options.configFile.parent_path() / g_Options.sourceDir / configLine.source;
+    permutation.blobName = PathToString(outputDir / shaderName);
+    permutation.outputTime = outputTime;
+    permutation.force = force;
+    permutation.reason = reason;
+    permutation.reasonDetail = reasonDetail;
 
-            // Include directories
-            for (const fs::path& path : g_Options.includeDirs)
-            {
-                args.push_back(L"-I");
-                args.push_back(path.wstring());
-            }
+    TaskData& taskData = permutation.taskData;
+    taskData.source = configLine.source;
+    taskData.entryPoint = configLine.entryPoint;
+    taskData.profile = configLine.profile;
+    taskData.combinedDefines = combinedDefines;
+    taskData.outputFileWithoutExt = PathToString(outputDir / permutationName);
+    taskData.defines = configLine.defines;
+    taskData.optimizationLevel = optimizationLevel;
 
-            // Args
-            args.push_back(optimizationLevelRemap[taskData.optimizationLevel]);
+    return true;
+}
 
-            uint32_t shaderModelIndex = (g_Options.shaderModel[0] - '0') * 10 + (g_Options.shaderModel[2] - '0');
-            if (shaderModelIndex >= 62)
-                args.push_back(L"-enable-16bit-types");
+// Sets the reason of a rebuild caused by a difference from the previous build
+void ExplainManifestMismatch(Permutation& permutation)
+{
+    auto found = g_Manifest.find(permutation.taskData.outputFileWithoutExt);
+    if (found == g_Manifest.end())
+        permutation.reason = "no-previous-build";
+    else if (found->second.optionsHash != permutation.taskData.optionsHash)
+        permutation.reason = "options-changed";
+    else
+        permutation.reason = "content-changed";
+}
 
-            if (g_Options.warningsAreErrors)
-                args.push_back(DXC_ARG_WARNINGS_ARE_ERRORS);
+// Finds a dependency not older than the output, returns the include chain to it starting from the dependency
+bool FindNewerDependency(const string& file, uint32_t macroSetIndex, const fs::file_time_type& outputTime, unordered_set<string>& visited, vector<string>& outChain)
+{
+    if (!visited.insert(file).second)
+        return false;
 
-            if (g_Options.allResourcesBound)
-                args.push_back(DXC_ARG_ALL_RESOURCES_BOUND);
+    auto node = g_DependencyGraph.find(file);
+    if (node == g_DependencyGraph.end())
+        return false;
 
-            if (g_Options.matrixRowMajor)
-                args.push_back(DXC_ARG_PACK_MATRIX_ROW_MAJOR);
+    bool isFound = node->second.time >= outputTime;
+    for (size_t i = 0; i < node->second.includes.size() && !isFound; i++)
+    {
+        const ResolvedInclude& include = node->second.includes[i];
+        if (include.isFound && IsIncludeActive(include.condition, macroSetIndex))
+            isFound = FindNewerDependency(include.file.string(), macroSetIndex, outputTime, visited, outChain);
+    }
 
-            if (g_Options.hlsl2021)
-            {
-                args.push_back(L"-HV");
-                args.push_back(L"2021");
-            }
+    if (isFound)
+        outChain.push_back(PathToString(fs::path(file).lexically_normal()));
 
-            if (g_Options.pdb||g_Options.embedPdb)
-            {
-                // TODO: for SPIRV PDB can only be embedded, GetOutput(DXC_OUT_PDB) silently fails...
-                args.push_back(L"-Zi");
-                args.push_back(L"-Zsb"); // only binary code affects hash
-            }
-            
-            if (g_Options.embedPdb)
-                args.push_back(L"-Qembed_debug");
+    return isFound;
+}
 
-            if (g_Options.platform == SPIRV)
-            {
-                args.push_back(L"-spirv");
-                args.push_back(wstring(L"-fspv-target-env=vulkan") + AnsiToWide(g_Options.vulkanVersion));
+// Prints rebuild reasons grouped by kind and writes all of them into a tab-separated file
+void Explain(const vector<const Permutation*>& permutations)
+{
+    map<string, uint32_t> reasonCounts;
+    map<string, uint32_t> dependencyCounts;
 
-                if (g_Options.vulkanMemoryLayout)
-                    args.push_back(wstring(L"-fvk-use-") + AnsiToWide(g_Options.vulkanMemoryLayout) + wstring(L"-layout"));
+    ostringstream text;
+    text << "output\treason\tdetail\n";
 
-                for (const string& ext : g_Options.spirvExtensions)
-                    args.push_back(wstring(L"-fspv-extension=") + AnsiToWide(ext));
+    for (const Permutation* permutation : permutations)
+    {
+        reasonCounts[permutation->reason]++;
+        if (permutation->reason == "newer-dependency" && !permutation->reasonDetail.empty())
+            dependencyCounts[permutation->reasonDetail.substr(0, permutation->reasonDetail.find(" <- "))]++;
 
-                for (const wstring& arg : regShifts)
-                    args.push_back(arg);
-            }
-            else // Not supported by SPIRV gen
-            {
-                if (g_Options.stripReflection)
-                    args.push_back(L"-Qstrip_reflect");
-            }
+        text << permutation->taskData.outputFileWithoutExt << '\t' << permutation->reason << '\t' << permutation->reasonDetail << '\n';
+    }
 
-            for (string const& options : g_Options.compilerOptions)
-            {
-                TokenizeCompilerOptions(options.c_str(), args);
-            }
+    fs::path file = GetStateFile(".explain.tsv");
 
-            // Debug output
-            if (g_Options.verbose)
-            {
-                wstringstream cmd;
-                for (const wstring& arg : args)
-                {
-                    cmd << arg;
-                    cmd << L" ";
-                }
+    Printf(WHITE "Rebuild reasons (all tasks are listed in '%s'):\n", PathToString(file).c_str());
+    for (const auto& [reason, count] : reasonCounts)
+        Printf(WHITE "%8u %s\n", count, reason.c_str());
 
-                Printf(WHITE "%ls\n", cmd.str().c_str());
-            }
+    // The most impactful dependencies first
+    vector<pair<uint32_t, string>> dependencies;
+    for (const auto& [dependency, count] : dependencyCounts)
+        dependencies.push_back({count, dependency});
+    sort(dependencies.begin(), dependencies.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
 
-            // Now that args are finalized, get their C-string pointers into a vector
-            vector<const wchar_t*> argPointers;
-            argPointers.reserve(args.size());
-            for (const wstring& arg : args)
-                argPointers.push_back(arg.c_str());
+    if (!dependencies.empty())
+        Printf(WHITE "Newer dependencies:\n");
+    for (size_t i = 0; i < dependencies.size() && i < 10; i++)
+        Printf(WHITE "%8u %s\n", dependencies[i].first, dependencies[i].second.c_str());
 
-            // Compiling the shader
-            DxcBuffer sourceBuffer = {};
-            sourceBuffer.Ptr = sourceBlob->GetBufferPointer();
-            sourceBuffer.Size = sourceBlob->GetBufferSize();
+    // Includes under such conditions are considered active, they can make permutations depend on more files
+    if (!g_UnseenMacros.empty())
+    {
+        string macros;
+        for (const string& macro : g_UnseenMacros)
+            macros += (macros.empty() ? "" : ", ") + macro;
 
-            ComPtr<IDxcIncludeHandler> pDefaultIncludeHandler;
-            dxcUtils->CreateDefaultIncludeHandler(&pDefaultIncludeHandler);
+        Printf(WHITE "Include conditions with macros, which neither permutations nor scanned files define (treated as unknown): %s\n", macros.c_str());
+    }
 
-            ComPtr<IDxcResult> dxcResult;
-            hr = dxcCompiler->Compile(&sourceBuffer, argPointers.data(), (uint32_t)args.size(), pDefaultIncludeHandler.Get(), IID_PPV_ARGS(&dxcResult));
+    string str = text.str();
+    error_code ec;
+    fs::create_directories(file.parent_path(), ec);
+    DataOutputContext context(PathToString(file).c_str(), false);
+    if (!context.stream || !context.WriteDataAsBinary(str.data(), str.size()))
+        Printf(YELLOW "WARNING: Can't write '%s'!\n", PathToString(file).c_str());
+}
 
-            if (SUCCEEDED(hr))
-                dxcResult->GetStatus(&hr);
+// Ranks includes by the number of shaders and permutations, which a change of them would rebuild. If the task history
+// is known, the ranking is by the estimated compile time instead
+void ReportRebuildImpact()
+{
+    struct Impact
+    {
+        unordered_set<uint32_t> shaders;
+        uint32_t permutationNum = 0;
+        double cost = 0.0; // ms
+    };
+
+    TaskEstimator estimator;
+    bool hasCost = estimator.IsValid();
+
+    unordered_map<string, Impact> impacts; // key = normalized file
+    map<pair<string, uint32_t>, vector<string>> closures; // key = {source, macroSetIndex}
+    unordered_map<string, string> normalizedPaths;
+    unordered_map<string, uint32_t> shaderIndices;
+
+    auto normalize = [&](const string& path) -> const string&
+    {
+        auto found = normalizedPaths.find(path);
+        if (found == normalizedPaths.end())
+            found = normalizedPaths.emplace(path, NormalizePath(path)).first;
 
-            if (dxcResult)
-            {
-                dxcResult->GetResult(&codeBlob);
-                dxcResult->GetErrorBuffer(&errorBlob);
-            }
+        return found->second;
+    };
 
-            isSucceeded = SUCCEEDED(hr) && codeBlob;
+    for (const Permutation& permutation : g_Permutations)
+    {
+        string source = permutation.sourceFile.string();
+        const vector<string>* files;
 
-            // Dump PDB
-            if (isSucceeded && g_Options.pdb)
+        auto reported = g_Manifest.find(permutation.taskData.outputFileWithoutExt);
+        if (g_Options.compilerDeps && reported != g_Manifest.end() && !reported->second.dependencies.empty())
+            files = &reported->second.dependencies;
+        else
+        {
+            auto [closure, isNew] = closures.try_emplace({source, permutation.macroSetIndex});
+            if (isNew)
             {
-                ComPtr<IDxcBlob> pdb;
-                ComPtr<IDxcBlobUtf16> pdbName;
-                if (SUCCEEDED(dxcResult->GetOutput(DXC_OUT_PDB, IID_PPV_ARGS(&pdb), &pdbName)))
+                // Includes active for the macro set
+                unordered_set<string> visited = {source};
+                vector<string> stack = {source};
+                while (!stack.empty())
                 {
-                    wstring file = fs::path(taskData.outputFileWithoutExt).parent_path().wstring() + L"/" + _L(PDB_DIR) + L"/" + wstring(pdbName->GetStringPointer());
-                    FILE* fp = _wfopen(file.c_str(), L"wb");
-                    if (fp)
+                    string file = move(stack.back());
+                    stack.pop_back();
+                    closure->second.push_back(file);
+
+                    auto node = g_DependencyGraph.find(file);
+                    if (node == g_DependencyGraph.end())
+                        continue;
+
+                    for (const ResolvedInclude& include : node->second.includes)
                     {
-                        fwrite(pdb->GetBufferPointer(), pdb->GetBufferSize(), 1, fp);
-                        fclose(fp);
+                        if (include.isFound && IsIncludeActive(include.condition, permutation.macroSetIndex) && visited.insert(include.file.string()).second)
+                            stack.push_back(include.file.string());
                     }
                 }
             }
+
+            files = &closure->second;
         }
 
-        if (g_Terminate)
-            break;
+        const string& normalizedSource = normalize(source);
+        uint32_t shaderIndex = shaderIndices.emplace(normalizedSource, (uint32_t)shaderIndices.size()).first->second;
+        float cost = hasCost ? estimator.EstimateDuration(permutation.taskData) : 0.0f;
 
-        // Dump output
-        if (isSucceeded)
-            DumpShader(taskData, (uint8_t*)codeBlob->GetBufferPointer(), codeBlob->GetBufferSize());
+        for (const string& file : *files)
+        {
+            const string& normalizedFile = normalize(file);
+            if (normalizedFile == normalizedSource)
+                continue;
 
-        // Update progress
-        UpdateProgress(taskData, isSucceeded, false, errorBlob ? (char*)errorBlob->GetBufferPointer() : nullptr);
+            Impact& impact = impacts[normalizedFile];
+            impact.shaders.insert(shaderIndex);
+            impact.permutationNum++;
+            impact.cost += cost;
+        }
     }
-}
 
-#endif
+    vector<pair<string, const Impact*>> ranking;
+    for (const auto& [file, impact] : impacts)
+        ranking.push_back({file, &impact});
 
-//=====================================================================================================================
-// EXE
-//=====================================================================================================================
+    sort(ranking.begin(), ranking.end(), [](const auto& a, const auto& b)
+    {
+        if (a.second->cost != b.second->cost)
+            return a.second->cost > b.second->cost;
 
-bool ReadBinaryFile(const char* file, vector<uint8_t>& outData)
-{
-    FILE* stream = fopen(file, "rb");
-    if (!stream)
+        if (a.second->permutationNum != b.second->permutationNum)
+            return a.second->permutationNum > b.second->permutationNum;
+
+        return a.first < b.first;
+    });
+
+    ostringstream text;
+    text << "file\tshaders\tpermutations" << (hasCost ? "\tcost_ms\n" : "\n");
+    for (const auto& [file, impact] : ranking)
     {
-        Printf(RED "ERROR: Can't open file '%s'!\n", file);
-        return false;
+        text << file << '\t' << impact->shaders.size() << '\t' << impact->permutationNum;
+        if (hasCost)
+            text << '\t' << (uint64_t)impact->cost;
+        text << '\n';
     }
 
-    uint32_t const binarySize = GetFileLength(stream);
-    if (binarySize == 0)
+    fs::path file = GetStateFile(".impact.tsv");
+
+    Printf(WHITE "Most expensive includes to touch (all of them are listed in '%s'):\n", PathToString(file).c_str());
+    if (hasCost)
     {
-        Printf(RED "ERROR: Binary file '%s' is empty!\n", file);
-        fclose(stream);
-        return false;
+        Printf(WHITE "%12s %12s %8s  %s\n", "cost (ms)", "permutations", "shaders", "file");
+        for (size_t i = 0; i < ranking.size() && i < 20; i++)
+            Printf(WHITE "%12.0f %12u %8u  %s\n", ranking[i].second->cost, ranking[i].second->permutationNum, (uint32_t)ranking[i].second->shaders.size(), ranking[i].first.c_str());
+    }
+    else
+    {
+        Printf(WHITE "%12s %8s  %s\n", "permutations", "shaders", "file");
+        for (size_t i = 0; i < ranking.size() && i < 20; i++)
+            Printf(WHITE "%12u %8u  %s\n", ranking[i].second->permutationNum, (uint32_t)ranking[i].second->shaders.size(), ranking[i].first.c_str());
     }
 
-    // Warn if the file is suspiciously large
-    if (binarySize > (64 << 20)) // > 64Mb
-        Printf(YELLOW "WARNING: Binary file '%s' is too large!\n", file);
+    string str = text.str();
+    error_code ec;
+    fs::create_directories(file.parent_path(), ec);
+    DataOutputContext context(PathToString(file).c_str(), false);
+    if (!context.stream || !context.WriteDataAsBinary(str.data(), str.size()))
+        Printf(YELLOW "WARNING: Can't write '%s'!\n", PathToString(file).c_str());
+}
 
-    // Allocate memory foe the whole file
-    outData.resize(binarySize);
+// Checks files, which the compiler has read during the last compilation of a permutation. A missing one means that
+// includes have changed, which can only make the permutation out of date
+bool IsUpToDateByCompilerDependencies(Permutation& permutation, const ManifestEntry& entry)
+{
+    fs::file_time_type dependenciesTime = fs::file_time_type::min();
+    uint64_t dependenciesHash = 0;
 
-    // Read the file
-    size_t bytesRead = fread(outData.data(), 1, binarySize, stream);
-    bool success = (bytesRead == binarySize);
+    for (const string& dependency : entry.dependencies)
+    {
+        fs::file_time_type time;
+        DependencyCacheEntry dependencyEntry;
+        if (!GetFileIncludes(dependency, time, dependencyEntry))
+        {
+            permutation.reason = "missing-dependency";
+            permutation.reasonDetail = dependency;
 
-    fclose(stream);
-    return success;
+            return false;
+        }
+
+        if (time >= permutation.outputTime && permutation.reasonDetail.empty())
+            permutation.reasonDetail = dependency;
+
+        dependenciesTime = max(dependenciesTime, time);
+        dependenciesHash = Hash(dependencyEntry.hash, Hash(dependency, dependenciesHash));
+    }
+
+    permutation.taskData.dependencies = entry.dependencies;
+    permutation.taskData.hash = Hash(dependenciesHash, permutation.taskData.optionsHash);
+
+    bool isUpToDate;
+    if (g_Options.contentHash)
+        isUpToDate = IsUpToDateInManifest(permutation.taskData);
+    else
+        isUpToDate = entry.optionsHash == permutation.taskData.optionsHash && permutation.outputTime > dependenciesTime;
+
+    if (!isUpToDate)
+    {
+        ExplainManifestMismatch(permutation);
+        if (permutation.reason == "content-changed" && !g_Options.contentHash)
+            permutation.reason = "newer-dependency";
+        else
+            permutation.reasonDetail.clear();
+    }
+    else
+        permutation.reasonDetail.clear();
+
+    return isUpToDate;
 }
 
-void ExeCompile()
+// Checks dependencies of all permutations and creates tasks for out-of-date ones
+bool CreateTasks(uint32_t threadsNum)
 {
-    static const char* optimizationLevelRemap[] = {
-        " -Od",
-        " -O1",
-        " -O2",
-        " -O3",
-    };
+    // Permutations with dependencies reported by the compiler don't need include scanning
+    vector<const ManifestEntry*> reportedEntries(g_Permutations.size());
+    vector<fs::path> sourceFiles;
 
-    while (!g_Terminate)
+    for (size_t i = 0; i < g_Permutations.size(); i++)
     {
-        // Getting a task in the current thread
-        TaskData taskData;
-        {
-            lock_guard<mutex> guard(g_TaskMutex);
-            if (g_TaskData.empty())
-                return;
+        const Permutation& permutation = g_Permutations[i];
 
-            taskData = g_TaskData.back();
-            g_TaskData.pop_back();
+        if (g_Options.compilerDeps)
+        {
+            auto found = g_Manifest.find(permutation.taskData.outputFileWithoutExt);
+            if (found != g_Manifest.end() && !found->second.dependencies.empty())
+                reportedEntries[i] = &found->second;
         }
 
-        bool convertBinaryOutputToHeader = false;
-        string outputFile = taskData.outputFileWithoutExt + g_OutputExt;
+        if (!reportedEntries[i])
+            sourceFiles.push_back(permutation.sourceFile);
+    }
 
-        // Building command line
-        ostringstream cmd;
-        {
-            #ifdef _WIN32 // workaround for Windows
-                cmd << "%COMPILER%";
-            #else
-                cmd << "$COMPILER";
-            #endif
+    ScanDependencies(sourceFiles, threadsNum);
 
-            if (g_Options.slang)
-            {
-                if (g_Options.header || (g_Options.headerBlob && taskData.combinedDefines.empty()))
-                    convertBinaryOutputToHeader = true;
+    // Conditions of includes are evaluated per permutation, using its defines. Macros defined in files can't be
+    // evaluated without preprocessing, as well as anything passed via raw compiler options
+    for (const auto& [file, node] : g_DependencyGraph)
+        g_UnknownMacros.insert(node.macros.begin(), node.macros.end());
 
-                // Slang defaults to slang language mode unless -lang <other language> sets something else.
-                // For HLSL compatibility mode:
-                //    - use -lang hlsl to set language mode to HLSL
-                //    - use -unscoped-enums so Slang doesn't require all enums to be scoped                
-                if (g_Options.slangHlsl) {              
-                    // Language mode: hlsl
-                    cmd << " -lang hlsl";
+    for (const string& compilerOption : g_Options.compilerOptions)
+    {
+        if (compilerOption.find("-D") != string::npos || compilerOption.find("/D") != string::npos || compilerOption.find("-U") != string::npos)
+            g_IsConditionEvaluationEnabled = false;
+    }
 
-                    // Treat enums as unscoped
-                    cmd << " -unscoped-enum";
-                }
+    map<vector<string>, uint32_t> macroSetIndices;
+    for (Permutation& permutation : g_Permutations)
+    {
+        auto [it, isNew] = macroSetIndices.try_emplace(permutation.taskData.defines, (uint32_t)g_MacroSets.size());
+        permutation.macroSetIndex = it->second;
 
-                // Profile
-                cmd << " -profile " << taskData.profile << "_" << g_Options.shaderModel;
-                
-                // Target/platform
-                cmd << " -target " << g_PlatformSlangTargets[g_Options.platform];
+        if (isNew)
+        {
+            MacroSet& macroSet = g_MacroSets.emplace_back();
 
-                // Output
-                cmd << " -o " << EscapePath(outputFile);
+            vector<string> defines = g_Options.defines;
+            defines.insert(defines.end(), permutation.taskData.defines.begin(), permutation.taskData.defines.end());
 
-                // Entry point
-                if (taskData.profile != "lib") {
-                    // Don't specify entry if profile is lib_*, Slang will use the entry point currently
-                    cmd << " -entry " << taskData.entryPoint;
-                }
+            for (const string& define : defines)
+            {
+                size_t equal = define.find('=');
+                if (equal == string::npos)
+                    macroSet.values[define] = "1";
+                else
+                    macroSet.values[define.substr(0, equal)] = define.substr(equal + 1);
 
-                // Defines
-                for (const string& define : taskData.defines)
-                    cmd << " -D " << define;
+                g_PermutationMacros.insert(define.substr(0, equal));
+            }
+        }
+    }
 
-                for (const string& define : g_Options.defines)
-                    cmd << " -D " << define;
+    vector<bool> isDirty(g_Permutations.size());
+    set<string> dirtyBlobs;
 
-                // Include directories
-                for (const fs::path& dir : g_Options.includeDirs)
-                    cmd << " -I " << EscapePath(dir.string());
+    for (size_t i = 0; i < g_Permutations.size(); i++)
+    {
+        Permutation& permutation = g_Permutations[i];
+        permutation.taskData.optionsHash = GetOptionsHash(permutation.taskData);
 
-                // Optimization level
-                cmd << " -O" << taskData.optimizationLevel;
+        if (reportedEntries[i])
+        {
+            isDirty[i] = permutation.force || !IsUpToDateByCompilerDependencies(permutation, *reportedEntries[i]);
+            if (isDirty[i] && g_Options.IsBlob())
+                dirtyBlobs.insert(permutation.blobName);
 
-                // Warnings as errors
-                if (g_Options.warningsAreErrors)
-                    cmd << " -warnings-as-errors";
+            continue;
+        }
 
-                // Matrix layout
-                if (g_Options.matrixRowMajor)
-                    cmd << " -matrix-layout-row-major";
-                else
-                    cmd << " -matrix-layout-column-major";
+        // Hashes are always recorded, so switching between modes can't leave stale manifest entries behind
+        vector<string> callStack;
+        uint64_t sourceHash;
+        if (GetHierarchicalHash(permutation.sourceFile, permutation.macroSetIndex, callStack, sourceHash))
+            permutation.taskData.hash = Hash(sourceHash, permutation.taskData.optionsHash);
 
-                if (g_Options.platform == SPIRV)
-                {
-                    // Uses the entrypoint name from the source instead of 'main' in the SPIRV output
-                    cmd << " -fvk-use-entrypoint-name";
-
-                    if (g_Options.vulkanMemoryLayout)
-                    {   
-                        if (strcmp(g_Options.vulkanMemoryLayout, "scalar") == 0)
-                            cmd << " -force-glsl-scalar-layout";
-                        else if (strcmp(g_Options.vulkanMemoryLayout, "gl") == 0)
-                            cmd << " -fvk-use-gl-layout";
-                    }
-                    
-                    if (!g_Options.noRegShifts)
-                    {
-                        for (uint32_t space = 0; space < SPIRV_SPACES_NUM; space++)
-                        {
-                            cmd << " -fvk-s-shift " << g_Options.sRegShift << " " << space;
-                            cmd << " -fvk-t-shift " << g_Options.tRegShift << " " << space;
-                            cmd << " -fvk-b-shift " << g_Options.bRegShift << " " << space;
-                            cmd << " -fvk-u-shift " << g_Options.uRegShift << " " << space;
-                        }
-                    }
-                }
+        isDirty[i] = permutation.force;
+        if (!permutation.force)
+        {
+            list<fs::path> callStack;
+            fs::file_time_type sourceTime;
+            if (!GetHierarchicalUpdateTime(permutation.sourceFile, permutation.macroSetIndex, callStack, sourceTime))
+                return false;
 
-                // Custom options
-                for (string const& options : g_Options.compilerOptions)
-                    cmd << " " << options;
-            }
+            if (g_Options.contentHash)
+                isDirty[i] = !IsUpToDateInManifest(permutation.taskData);
             else
+                isDirty[i] = !AreOptionsUpToDateInManifest(permutation.taskData) || permutation.outputTime <= sourceTime;
+
+            if (isDirty[i] && g_Options.explain)
             {
-                cmd << " -nologo";
+                ExplainManifestMismatch(permutation);
 
-                // Output file
-                if (g_Options.binary || g_Options.binaryBlob || (g_Options.headerBlob && !taskData.combinedDefines.empty()))
-                    cmd << " -Fo " << EscapePath(outputFile);
-                if (g_Options.header || (g_Options.headerBlob && taskData.combinedDefines.empty()))
+                if (!g_Options.contentHash && permutation.reason == "content-changed")
                 {
-                    string name = GetShaderName(taskData.outputFileWithoutExt);
+                    vector<string> chain;
+                    unordered_set<string> visited;
+                    FindNewerDependency(permutation.sourceFile.string(), permutation.macroSetIndex, permutation.outputTime, visited, chain);
 
-                    cmd << " -Fh " << EscapePath(outputFile) << ".h";
-                    cmd << " -Vn " << name;
+                    permutation.reason = "newer-dependency";
+                    for (const string& file : chain)
+                        permutation.reasonDetail += (permutation.reasonDetail.empty() ? "" : " <- ") + file;
                 }
+            }
+        }
 
-                // Profile
-                string profile = taskData.profile + "_";
-                if (g_Options.platform == DXBC)
-                    profile += "5_0";
-                else
-                    profile += g_Options.shaderModel;
-                cmd << " -T " << profile;
+        if (isDirty[i] && g_Options.IsBlob())
+            dirtyBlobs.insert(permutation.blobName);
+    }
+
+    // Up-to-date permutations of a dirty binary blob can be taken from its previous version
+    map<string, vector<string>> previousPermutations;
+    if (g_Options.binaryBlob && !g_Options.binary)
+    {
+        for (const string& blobName : dirtyBlobs)
+        {
+            string file = blobName + g_OutputExt;
+            if (!fs::exists(file))
+                continue;
+
+            vector<uint8_t>& data = g_PreviousBlobs[blobName];
+            if (ReadBinaryFile(file.c_str(), data))
+                ShaderMake::EnumeratePermutationsInBlob(data.data(), data.size(), previousPermutations[blobName]);
+        }
+    }
+
+    vector<const Permutation*> explained;
+    for (size_t i = 0; i < g_Permutations.size(); i++)
+    {
+        Permutation& permutation = g_Permutations[i];
+
+        // A blob is always rebuilt from all its permutations. Up-to-date ones need recompilation only if
+        // their intermediate files are not kept and the previous blob doesn't have them
+        bool isInDirtyBlob = dirtyBlobs.find(permutation.blobName) != dirtyBlobs.end();
 
-                // Entry point
-                cmd << " -E " << taskData.entryPoint;
+        BlobEntry entry;
+        entry.permutationFileWithoutExt = permutation.taskData.outputFileWithoutExt;
+        entry.combinedDefines = permutation.taskData.combinedDefines;
 
-                // Defines
-                for (const string& define : taskData.defines)
-                    cmd << " -D " << define;
+        if (isInDirtyBlob && !isDirty[i] && !g_Options.binary)
+        {
+            auto found = previousPermutations.find(permutation.blobName);
+            if (found != previousPermutations.end())
+            {
+                auto index = find(found->second.begin(), found->second.end(), entry.combinedDefines);
+                if (index != found->second.end())
+                    entry.previousIndex = (uint32_t)(index - found->second.begin());
+            }
+        }
 
-                for (const string& define : g_Options.defines)
-                    cmd << " -D " << define;
+        if (isDirty[i] || (isInDirtyBlob && !g_Options.binary && entry.previousIndex == UINT32_MAX))
+        {
+            g_TaskData.push_back(permutation.taskData);
 
-                // Include directories
-                for (const fs::path& dir : g_Options.includeDirs)
-                    cmd << " -I " << EscapePath(dir.string());
+            if (!isDirty[i])
+            {
+                permutation.reason = "blob-rebuild";
+                permutation.reasonDetail = permutation.blobName;
+            }
 
-                // Args
-                cmd << optimizationLevelRemap[taskData.optimizationLevel];
+            explained.push_back(&permutation);
+        }
 
-                uint32_t shaderModelIndex = (g_Options.shaderModel[0] - '0') * 10 + (g_Options.shaderModel[2] - '0');
-                if (g_Options.platform != DXBC && shaderModelIndex >= 62)
-                    cmd << " -enable-16bit-types";
+        // Gather blobs
+        if (isInDirtyBlob)
+            g_ShaderBlobs[permutation.blobName].push_back(entry);
+    }
 
-                if (g_Options.warningsAreErrors)
-                    cmd << " -WX";
+    if (g_Options.explain && !explained.empty())
+        Explain(explained);
 
-                if (g_Options.allResourcesBound)
-                    cmd << " -all_resources_bound";
+    if (g_Options.impact)
+        ReportRebuildImpact();
 
-                if (g_Options.matrixRowMajor)
-                    cmd << " -Zpr";
+    return true;
+}
 
-                if (g_Options.hlsl2021)
-                    cmd << " -HV 2021";
+bool ExpandPermutations(uint32_t lineIndex, const string& line)
+{
+    size_t opening = line.find('{');
+    if (opening == string::npos)
+        return ProcessConfigLine(lineIndex, line);
 
-                if (g_Options.pdb || g_Options.embedPdb)
-                    cmd << " -Zi -Zsb"; // only binary affects hash
+    size_t closing = line.find('}', opening);
+    if (closing == string::npos)
+    {
+        Printf(RED "%s(%u,0): ERROR: Missing '}'!\n", PathToString(g_Options.configFile).c_str(), lineIndex + 1);
 
-                if (g_Options.embedPdb)
-                    cmd << " -Qembed_debug";
+        return false;
+    }
 
-                if (g_Options.platform == SPIRV)
-                {
-                    cmd << " -spirv";
+    size_t current = opening + 1;
+    while (true)
+    {
+        size_t comma = line.find(',', current);
+        if (comma == string::npos || comma > closing)
+            comma = closing;
 
-                    cmd << " -fspv-target-env=vulkan" << g_Options.vulkanVersion;
+        string newConfig = line.substr(0, opening) + line.substr(current, comma - current) + line.substr(closing + 1);
+        if (!ExpandPermutations(lineIndex, newConfig))
+            return false;
 
-                    if (g_Options.vulkanMemoryLayout)
-                        cmd << " -fvk-use-" << g_Options.vulkanMemoryLayout << "-layout";
+        current = comma + 1;
+        if (comma >= closing)
+            break;
+    }
 
-                    for (const string& ext : g_Options.spirvExtensions)
-                        cmd << " -fspv-extension=" << ext;
+    return true;
+}
 
-                    if (!g_Options.noRegShifts)
-                    {
-                        for (uint32_t space = 0; space < SPIRV_SPACES_NUM; space++)
-                        {
-                            cmd << " -fvk-s-shift " << g_Options.sRegShift << " " << space;
-                            cmd << " -fvk-t-shift " << g_Options.tRegShift << " " << space;
-                            cmd << " -fvk-b-shift " << g_Options.bRegShift << " " << space;
-                            cmd << " -fvk-u-shift " << g_Options.uRegShift << " " << space;
-                        }
-                    }
-                }
-                else // Not supported by SPIRV gen
-                {
-                    if (g_Options.stripReflection)
-                        cmd << " -Qstrip_reflect";
+bool CreateBlob(const string& blobName, const vector<BlobEntry>& entries, bool useTextOutput)
+{
+    // Create output file
+    string outputFile = blobName;
+    outputFile += g_OutputExt;
+    if (useTextOutput)
+        outputFile += ".h";
 
-                    if (g_Options.pdb)
-                    {
-                        fs::path pdbPath = fs::path(outputFile).parent_path() / PDB_DIR;
-                        cmd << " -Fd " << EscapePath(pdbPath.string() + "/"); // only binary code affects hash
-                    }
-                }
+    DataOutputContext outputContext(outputFile.c_str(), useTextOutput);
+    if (!outputContext.stream)
+    {
+        Printf(RED "ERROR: Can't open output file '%s'!\n", outputFile.c_str());
 
-                // Custom options
-                for (string const& options : g_Options.compilerOptions)
-                    cmd << " " << options;
-            }
+        return false;
+    }
 
-            // Source file
-            fs::path sourceFile = g_Options.configFile.parent_path() / g_Options.sourceDir / taskData.source;
-            cmd << " " << EscapePath(sourceFile.string());
+    if (useTextOutput)
+    {
+        string name = GetShaderName(blobName);
+        outputContext.WriteTextPreamble(name.c_str());
+    }
+
+    ShaderMake::WriteFileCallback writeFileCallback = useTextOutput
+        ? &DataOutputContext::WriteDataAsTextCallback
+        : &DataOutputContext::WriteDataAsBinaryCallback;
+
+    // Write "blob" header
+    if (!ShaderMake::WriteFileHeader(writeFileCallback, &outputContext))
+    {
+        Printf(RED "ERROR: Failed to write into output file '%s'!\n", outputFile.c_str());
+
+        return false;
+    }
+
+    bool success = true;
+
+    // Collect individual permutations
+    for (const BlobEntry& entry : entries)
+    {
+        // Open compiled permutation file or take it from the previous blob
+        string file = entry.permutationFileWithoutExt + g_OutputExt;
+
+        vector<uint8_t> fileData;
+        bool isRead;
+        if (entry.previousIndex != UINT32_MAX)
+        {
+            const vector<uint8_t>& previousBlob = g_PreviousBlobs[blobName];
+
+            const void* binary = nullptr;
+            size_t binarySize = 0;
+            isRead = ShaderMake::FindPermutationInBlobByIndex(previousBlob.data(), previousBlob.size(), entry.previousIndex, &binary, &binarySize);
+            if (isRead)
+                fileData.assign((const uint8_t*)binary, (const uint8_t*)binary + binarySize);
+            else
+                Printf(RED "ERROR: Can't find permutation '%s' in the previous blob '%s'!\n", entry.combinedDefines.c_str(), blobName.c_str());
+        }
+        else
+            isRead = ReadBinaryFile(file.c_str(), fileData);
+
+        if (isRead)
+        {
+            if (!ShaderMake::WritePermutation(writeFileCallback, &outputContext, entry.combinedDefines, fileData.data(), fileData.size()))
+            {
+                Printf(RED "ERROR: Failed to write a shader permutation into '%s'!\n", outputFile.c_str());
+                success = false;
+            }
         }
+        else
+            success = false;
+        
+        if (!success)
+            break;
+    }
 
-        cmd << " 2>&1";
+    if (useTextOutput)
+        outputContext.WriteTextEpilog();
 
-        // Debug output
-        if (g_Options.verbose)
-            Printf(WHITE "%s\n", cmd.str().c_str());
+    return success;
+}
 
-        // Compiling the shader
-        ostringstream msg;
-        FILE* pipe = popen(cmd.str().c_str(), "r");
+void RemoveIntermediateBlobFiles(const vector<BlobEntry>& entries)
+{
+    for (const BlobEntry& entry : entries)
+    {
+        if (entry.previousIndex != UINT32_MAX)
+            continue;
+
+        string file = entry.permutationFileWithoutExt + g_OutputExt;
+        fs::remove(file);
+    }
+}
+
+// Permutations of a blob, which hasn't been built, must not be considered up to date
+void RemoveBlobFromManifest(const vector<BlobEntry>& entries)
+{
+    for (const BlobEntry& entry : entries)
+        g_Manifest.erase(entry.permutationFileWithoutExt);
+
+    g_IsManifestDirty = true;
+}
+
+#define REGISTRY_STAMP_SIGNATURE 0x47524D53 // "SMRG"
+#define REGISTRY_STAMP_VERSION 1
 
-        bool isSucceeded = false, willRetry = false;
-        if (pipe)
-        {
-            char buf[1024];
-            while (fgets(buf, sizeof(buf), pipe))
-            {
-                // Ignore useless unmutable FXC message
-                if (strstr(buf, "compilation object save succeeded"))
-                    continue;
+// The registry layout depends on options, which don't change any file time
+uint64_t GetRegistryOptionsHash()
+{
+    uint64_t hash = Hash(string(g_Options.registry));
 
-                msg << buf;
-            }
+    return Hash((uint64_t)g_Options.registryDataFiles, hash);
+}
 
-            const int result = pclose(pipe);
-            // Check status, see https://pubs.opengroup.org/onlinepubs/009696699/functions/pclose.html
-            const bool childProcessError = (result == -1 && errno == ECHILD);
-#ifdef WIN32
-            const bool commandShellError = false;
-#else
-            const bool commandShellError = (WIFEXITED(result) && WEXITSTATUS(result) == 127);
-#endif
+// Data files left over from a run with a bigger "--registryDataFiles" would define duplicate symbols
+void RemoveStaleRegistryDataFiles(const fs::path& registryFile)
+{
+    string prefix = registryFile.filename().string() + "_data";
 
-            if (result == 0)
-                isSucceeded = true;
+    error_code ec;
+    for (const fs::directory_entry& entry : fs::directory_iterator(registryFile.parent_path(), ec))
+    {
+        string name = entry.path().filename().string();
+        if (name.size() <= prefix.size() + 4 || name.compare(0, prefix.size(), prefix) != 0 || entry.path().extension() != ".cpp")
+            continue;
 
-            // Retry if count > 0 and failed to execute child sub-process or command shell (posix only)
-            else if (g_TaskRetryCount > 0 && (childProcessError || commandShellError))
-                willRetry = true;
-        }
-        
-        // Slang cannot produce .h files directly, so we convert its binary output to .h here if needed
-        if (isSucceeded && convertBinaryOutputToHeader)
-        {
-            vector<uint8_t> buffer;
-            if (ReadBinaryFile(outputFile.c_str(), buffer))
-            {
-                string headerFile = taskData.outputFileWithoutExt + g_OutputExt + ".h";
-                DataOutputContext context(headerFile.c_str(), true);
-                if (context.stream)
-                {
-                    string shaderName = GetShaderName(taskData.outputFileWithoutExt);
-                    context.WriteTextPreamble(shaderName.c_str());
-                    context.WriteDataAsText(buffer.data(), buffer.size());
-                    context.WriteTextEpilog();
-
-                    // Delete the binary file if it's not requested
-                    if (!g_Options.binary)
-                        fs::remove(outputFile);
-                }
-                else
-                {
-                    Printf(RED "ERROR: Failed to open file '%s' for writing!\n", headerFile.c_str());
-                    isSucceeded = false;
-                }
-            }
-            else
-                isSucceeded = false;
-        }
+        string index = name.substr(prefix.size(), name.size() - prefix.size() - 4);
+        if (index.find_first_not_of("0123456789") != string::npos || strtoul(index.c_str(), nullptr, 10) < g_Options.registryDataFiles)
+            continue;
 
-        // Update progress
-        UpdateProgress(taskData, isSucceeded, willRetry, msg.str().c_str());
+        error_code removeEc;
+        if (!fs::remove(entry.path(), removeEc) || removeEc)
+            Printf(YELLOW "WARNING: Can't remove the stale registry file '%s'!\n", PathToString(entry.path()).c_str());
     }
 }
 
-//=====================================================================================================================
-// MAIN
-//=====================================================================================================================
-
-bool GetHierarchicalUpdateTime(const fs::path& file, list<fs::path>& callStack, fs::file_time_type& outTime)
+// Writes "name.h" declaring a table of all shader permutations sorted by name and defines, "name.cpp" with the table
+// and a binary search over it, and "name_data<N>.cpp" files with the shader data, so that they can compile in parallel
+bool CreateRegistry()
 {
-    static const basic_regex<char> includePattern("\\s*#include\\s+[\"<]([^>\"]+)[>\"].*");
+    vector<RegistryEntry>& entries = g_RegistryEntries;
+    sort(entries.begin(), entries.end(), [](const RegistryEntry& a, const RegistryEntry& b)
+        { return tie(a.shaderName, a.combinedDefines) < tie(b.shaderName, b.combinedDefines); });
+    entries.erase(unique(entries.begin(), entries.end(), [](const RegistryEntry& a, const RegistryEntry& b)
+        { return a.shaderName == b.shaderName && a.combinedDefines == b.combinedDefines; }), entries.end());
 
-    auto found = g_HierarchicalUpdateTimes.find(file);
-    if (found != g_HierarchicalUpdateTimes.end())
+    const char* name = g_Options.registry;
+    fs::path registryFile = fs::path(g_Options.outputDir) / name;
+
+    // Header
     {
-        outTime = found->second;
+        string file = PathToString(registryFile) + ".h";
+        DataOutputContext context(file.c_str(), true);
+        if (!context.stream)
+            return false;
 
-        return true;
+        fprintf(context.stream,
+            "// Generated by ShaderMake, do not edit\n"
+            "#pragma once\n"
+            "\n"
+            "#include <stddef.h>\n"
+            "#include <stdint.h>\n"
+            "\n"
+            "namespace %s\n"
+            "{\n"
+            "\n"
+            "struct Entry\n"
+            "{\n"
+            "    const char* name;\n"
+            "    const char* defines;\n"
+            "    const uint8_t* data;\n"
+            "    size_t size;\n"
+            "};\n"
+            "\n"
+            "// Sorted by \"name\", then by \"defines\"\n"
+            "extern const Entry g_Entries[];\n"
+            "extern const size_t g_EntryNum;\n"
+            "\n"
+            "// Returns the entry for a shader and its combined defines, i.e. \"A=1 B=0\", or nullptr if not found\n"
+            "const Entry* Find(const char* name, const char* defines);\n"
+            "\n"
+            "} // namespace %s\n",
+            name, name);
     }
 
-    ifstream stream(file);
-    if (!stream.is_open())
+    // Shader data, balanced over the data files by size
+    vector<size_t> dataFileSizes(g_Options.registryDataFiles, 0);
+    vector<vector<uint32_t>> dataFileEntries(g_Options.registryDataFiles);
+    vector<size_t> entrySizes(entries.size());
+    for (uint32_t i = 0; i < (uint32_t)entries.size(); i++)
     {
-        Printf(RED "ERROR: Can't open file '%s', included in:\n", PathToString(file).c_str());
-        for (const fs::path& otherFile : callStack)
-            Printf(RED "\t%s\n", PathToString(otherFile).c_str());
-
-        return false;
-    }
+        string file = entries[i].permutationFileWithoutExt + g_OutputExt;
 
-    callStack.push_front(file);
+        error_code ec;
+        entrySizes[i] = (size_t)fs::file_size(file, ec);
+        if (ec)
+        {
+            Printf(RED "ERROR: Can't open file '%s'!\n", file.c_str());
+            return false;
+        }
 
-    fs::path path = file.parent_path();
-    fs::file_time_type hierarchicalUpdateTime = fs::last_write_time(file);
+        size_t dataFileIndex = min_element(dataFileSizes.begin(), dataFileSizes.end()) - dataFileSizes.begin();
+        dataFileSizes[dataFileIndex] += entrySizes[i];
+        dataFileEntries[dataFileIndex].push_back(i);
+    }
 
-    for (string line; getline(stream, line);)
+    for (uint32_t i = 0; i < g_Options.registryDataFiles; i++)
     {
-        match_results<const char*> matchResult;
-        regex_match(line.c_str(), matchResult, includePattern);
-        if (matchResult.empty())
-            continue;
+        string file = PathToString(registryFile) + "_data" + to_string(i) + ".cpp";
+        DataOutputContext context(file.c_str(), true);
+        if (!context.stream)
+            return false;
 
-        fs::path includeName = string(matchResult[1]);
-        if (find(g_Options.relaxedIncludes.begin(), g_Options.relaxedIncludes.end(), includeName) != g_Options.relaxedIncludes.end())
-            continue;
+        fprintf(context.stream,
+            "// Generated by ShaderMake, do not edit\n"
+            "#include <stdint.h>\n"
+            "\n"
+            "namespace %s\n"
+            "{\n",
+            name);
 
-        bool isFound = false;
-        fs::path includeFile = path / includeName;
-        if (fs::exists(includeFile))
-            isFound = true;
-        else
+        for (uint32_t entryIndex : dataFileEntries[i])
         {
-            for (const fs::path& includePath : g_Options.includeDirs)
-            {
-                includeFile = includePath / includeName;
-                if (fs::exists(includeFile))
-                {
-                    isFound = true;
-                    break;
-                }
-            }
-        }
+            string binaryFile = entries[entryIndex].permutationFileWithoutExt + g_OutputExt;
 
-        if (!isFound)
-        {
-            Printf(RED "ERROR: Can't find include file '%s', included in:\n", PathToString(includeName).c_str());
-            for (const fs::path& otherFile : callStack)
-                Printf(RED "\t%s\n", PathToString(otherFile).c_str());
+            vector<uint8_t> fileData;
+            if (!ReadBinaryFile(binaryFile.c_str(), fileData))
+                return false;
 
-            return false;
+            string dataName = "g_Data" + to_string(entryIndex);
+            fprintf(context.stream, "\nextern ");
+            context.WriteTextPreamble(dataName.c_str());
+            context.WriteDataAsText(fileData.data(), fileData.size());
+            context.WriteTextEpilog();
         }
 
-        fs::file_time_type dependencyTime;
-        if (!GetHierarchicalUpdateTime(includeFile, callStack, dependencyTime))
+        fprintf(context.stream, "\n} // namespace %s\n", name);
+    }
+
+    // Index
+    {
+        string file = PathToString(registryFile) + ".cpp";
+        DataOutputContext context(file.c_str(), true);
+        if (!context.stream)
             return false;
 
-        hierarchicalUpdateTime = max(dependencyTime, hierarchicalUpdateTime);
+        fprintf(context.stream,
+            "// Generated by ShaderMake, do not edit\n"
+            "#include \"%s.h\"\n"
+            "\n"
+            "#include <string.h>\n"
+            "\n"
+            "namespace %s\n"
+            "{\n"
+            "\n",
+            name, name);
+
+        for (uint32_t i = 0; i < (uint32_t)entries.size(); i++)
+            fprintf(context.stream, "extern const uint8_t g_Data%u[];\n", i);
+
+        fprintf(context.stream, "\nconst Entry g_Entries[%zu] = {\n", max(entries.size(), size_t(1)));
+        for (uint32_t i = 0; i < (uint32_t)entries.size(); i++)
+        {
+            fprintf(context.stream, "    { \"%s\", \"%s\", g_Data%u, %zu },\n",
+                EscapeString(entries[i].shaderName).c_str(),
+                EscapeString(entries[i].combinedDefines).c_str(),
+                i, entrySizes[i]);
+        }
+
+        fprintf(context.stream,
+            "};\n"
+            "\n"
+            "const size_t g_EntryNum = %zu;\n"
+            "\n"
+            "const Entry* Find(const char* name, const char* defines)\n"
+            "{\n"
+            "    size_t first = 0;\n"
+            "    size_t last = g_EntryNum;\n"
+            "    while (first < last)\n"
+            "    {\n"
+            "        size_t middle = first + (last - first) / 2;\n"
+            "        const Entry& entry = g_Entries[middle];\n"
+            "\n"
+            "        int result = strcmp(entry.name, name);\n"
+            "        if (result == 0)\n"
+            "            result = strcmp(entry.defines, defines);\n"
+            "\n"
+            "        if (result == 0)\n"
+            "            return &entry;\n"
+            "        else if (result < 0)\n"
+            "            first = middle + 1;\n"
+            "        else\n"
+            "            last = middle;\n"
+            "    }\n"
+            "\n"
+            "    return nullptr;\n"
+            "}\n"
+            "\n"
+            "} // namespace %s\n",
+            entries.size(), name);
     }
 
-    callStack.pop_front();
+    RemoveStaleRegistryDataFiles(registryFile);
 
-    g_HierarchicalUpdateTimes[file] = hierarchicalUpdateTime;
-    outTime = hierarchicalUpdateTime;
+    StateFileWriter writer(REGISTRY_STAMP_SIGNATURE, REGISTRY_STAMP_VERSION);
+    writer.Write(GetRegistryOptionsHash());
+    if (!writer.Save(GetStateFile(".registry")))
+        Printf(YELLOW "WARNING: Can't save the registry stamp '%s'!\n", PathToString(GetStateFile(".registry")).c_str());
 
     return true;
 }
 
-bool ProcessConfigLine(uint32_t lineIndex, const string& line, const fs::file_time_type& configTime)
+inline string ToIdentifier(const string& s)
 {
-    // Tokenize
-    string lineCopy = line;
-    vector<const char*> tokens;
-    TokenizeConfigLine((char*)lineCopy.c_str(), tokens);
-
-    // Parse config line
-    ConfigLine configLine;
-    if (!configLine.Parse((int32_t)tokens.size(), tokens.data()))
+    string result = s;
+    for (char& ch : result)
     {
-        Printf(RED "%s(%u,0): ERROR: Can't parse config line!\n", PathToString(g_Options.configFile).c_str(), lineIndex + 1);
-
-        return false;
+        if (!IsIdentifierChar(ch))
+            ch = '_';
     }
 
-    // DXBC: skip unsupported profiles
-    string profile = configLine.profile;
-    if (g_Options.platform == DXBC && (profile == "lib" || profile == "ms" || profile == "as"))
-        return true;
+    if (!IsIdentifier(result.c_str()))
+        result = "_" + result;
 
-    // Concatenate define strings, i.e. to get something, like: "A=1 B=0 C"
-    string combinedDefines = "";
-    for (size_t i = 0; i < configLine.defines.size(); i++)
+    return result;
+}
+
+bool WriteTextFileIfChanged(const fs::path& file, const string& text)
+{
+    ifstream stream(file, ios::binary);
+    if (stream.is_open())
     {
-        combinedDefines += configLine.defines[i];
-        if (i != configLine.defines.size() - 1 )
-            combinedDefines += " ";
+        string oldText((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+        if (oldText == text)
+            return true;
     }
+    stream.close();
 
-    // Compiled shader name
-    fs::path shaderName = RemoveLeadingDotDots(configLine.source);
-    shaderName.replace_extension("");
-    if (g_Options.flatten || configLine.outputDir) // Specifying -o <path> for a shader removes the original path
-        shaderName = shaderName.filename();
-    if (strcmp(configLine.entryPoint, "main"))
-        shaderName += "_" + string(configLine.entryPoint);
-    if(configLine.outputSuffix)
-        shaderName += string(configLine.outputSuffix);
-
-    // Compiled permutation name
-    fs::path permutationName = shaderName;
-    if (!configLine.defines.empty())
-    {
-        uint32_t permutationHash = HashToUint(hash<string>()(combinedDefines));
+    DataOutputContext context(PathToString(file).c_str(), false);
+    if (!context.stream)
+        return false;
 
-        char buf[16];
-        snprintf(buf, sizeof(buf), "_%08X", permutationHash);
+    return context.WriteDataAsBinary(text.data(), text.size());
+}
 
-        permutationName += buf;
-    }
+// Writes a header with an enum per varying define, a "Permutation" struct and functions mapping it to the index of
+// the permutation in the blob and to its key, i.e. "A=1 B=0", without any string formatting at runtime
+bool CreatePermutationHeader(const string& shaderName, const ShaderPermutations& permutations)
+{
+    const vector<vector<string>>& defines = permutations.defines;
 
-    // Output directory
-    fs::path outputDir = g_Options.outputDir;
-    if (configLine.outputDir)
-        outputDir /= configLine.outputDir;
+    struct Domain
+    {
+        string name;
+        string identifier;
+        vector<string> values;
+        uint64_t stride = 0;
+    };
 
-    // Create intermediate output directories
-    bool force = g_Options.force;
-    fs::path endPath = outputDir / shaderName.parent_path();
-    if (g_Options.pdb)
-        endPath /= PDB_DIR;
-    if (endPath.string() != "" && !fs::exists(endPath))
+    // Gather the domain of each define, all permutations must have the same defines in the same order
+    vector<Domain> domains(defines[0].size());
+    for (const vector<string>& permutationDefines : defines)
     {
-        fs::create_directories(endPath);
-        force = true;
-    }
+        bool isValid = permutationDefines.size() == domains.size();
+        for (size_t i = 0; i < domains.size() && isValid; i++)
+        {
+            const string& define = permutationDefines[i];
+            size_t assignment = define.find('=');
+            string name = define.substr(0, assignment);
+            string value = assignment == string::npos ? "" : define.substr(assignment + 1);
 
-    // Early out if no changes detected
-    fs::file_time_type zero; // constructor sets to 0
-    fs::file_time_type outputTime = zero;
+            if (domains[i].name.empty())
+                domains[i].name = name;
 
-    {
-        fs::path outputFile = outputDir / permutationName;
+            isValid = domains[i].name == name;
+            if (find(domains[i].values.begin(), domains[i].values.end(), value) == domains[i].values.end())
+                domains[i].values.push_back(value);
+        }
 
-        outputFile += g_OutputExt;
-        if (g_Options.binary)
+        if (!isValid)
         {
-            force |= !fs::exists(outputFile);
-            if (!force)
-            {
-                if (outputTime == zero)
-                    outputTime = fs::last_write_time(outputFile);
-                else
-                    outputTime = min(outputTime, fs::last_write_time(outputFile));
-            }
+            Printf(YELLOW "WARNING: Can't generate typed permutations for '%s', its permutations don't share the same defines!\n", shaderName.c_str());
+            return true;
         }
+    }
 
-        outputFile += ".h";
-        if (g_Options.header)
+    // Constant defines are not a part of the permutation
+    domains.erase(remove_if(domains.begin(), domains.end(), [](const Domain& domain) { return domain.values.size() < 2; }), domains.end());
+    if (domains.empty())
+        return true;
+
+    // Defines become enum and member names
+    for (Domain& domain : domains)
+    {
+        domain.identifier = IsIdentifier(domain.name.c_str()) ? domain.name : ToIdentifier(domain.name);
+        for (const Domain& other : domains)
         {
-            force |= !fs::exists(outputFile);
-            if (!force)
+            if (&other != &domain && other.identifier == domain.identifier)
             {
-                if (outputTime == zero)
-                    outputTime = fs::last_write_time(outputFile);
-                else
-                    outputTime = min(outputTime, fs::last_write_time(outputFile));
+                Printf(YELLOW "WARNING: Can't generate typed permutations for '%s', defines '%s' and '%s' map to the same identifier '%s'!\n",
+                    shaderName.c_str(), other.name.c_str(), domain.name.c_str(), domain.identifier.c_str());
+                return true;
             }
         }
     }
 
+    // The number of all combinations of define values, which can be far bigger than the number of permutations
+    uint64_t combinationNum = 1;
+    for (auto it = domains.rbegin(); it != domains.rend(); ++it)
     {
-        fs::path outputFile = outputDir / shaderName;
-
-        outputFile += g_OutputExt;
-        if (g_Options.binaryBlob)
+        if (combinationNum > UINT64_MAX / it->values.size())
         {
-            force |= !fs::exists(outputFile);
-            if (!force)
-            {
-                if (outputTime == zero)
-                    outputTime = fs::last_write_time(outputFile);
-                else
-                    outputTime = min(outputTime, fs::last_write_time(outputFile));
-            }
+            Printf(YELLOW "WARNING: Can't generate typed permutations for '%s', too many combinations of define values!\n", shaderName.c_str());
+            return true;
         }
 
-        outputFile += ".h";
-        if (g_Options.headerBlob)
+        it->stride = combinationNum;
+        combinationNum *= it->values.size();
+    }
+
+    // Combination index of each permutation, the first permutation wins for duplicates
+    vector<pair<uint64_t, uint32_t>> entries; // {combination, blob index}
+    for (uint32_t i = 0; i < (uint32_t)defines.size(); i++)
+    {
+        uint64_t combination = 0;
+        for (const Domain& domain : domains)
         {
-            force |= !fs::exists(outputFile);
-            if (!force)
+            for (const string& define : defines[i])
             {
-                if (outputTime == zero)
-                    outputTime = fs::last_write_time(outputFile);
-                else
-                    outputTime = min(outputTime, fs::last_write_time(outputFile));
+                size_t assignment = define.find('=');
+                if (define.substr(0, assignment) == domain.name)
+                {
+                    string value = assignment == string::npos ? "" : define.substr(assignment + 1);
+                    combination += uint64_t(find(domain.values.begin(), domain.values.end(), value) - domain.values.begin()) * domain.stride;
+                    break;
+                }
             }
         }
+
+        entries.push_back({combination, i});
     }
 
-    if (!force)
-    {
-        list<fs::path> callStack;
-        fs::file_time_type sourceTime;
-        fs::path sourceFile = g_Options.configFile.parent_path() / g_Options.sourceDir / configLine.source;
-        if (!GetHierarchicalUpdateTime(sourceFile, callStack, sourceTime))
-            return false;
+    stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    entries.erase(unique(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first == b.first; }), entries.end());
 
-        sourceTime = max(sourceTime, configTime);
-        if (outputTime > sourceTime)
-            return true;
-    }
+    // A dense table is indexed by the combination, it's used only if it's not much bigger than the number of permutations.
+    // Otherwise the sorted combinations are searched
+    bool isDense = combinationNum <= max<uint64_t>(defines.size() * 4, 64);
 
-    // Prepare a task
-    string outputFileWithoutExt = PathToString(outputDir / permutationName);
-    uint32_t optimizationLevel = configLine.optimizationLevel == USE_GLOBAL_OPTIMIZATION_LEVEL ? g_Options.optimizationLevel : configLine.optimizationLevel;
-    optimizationLevel = min(optimizationLevel, 3u);
+    bool isIdentity = combinationNum == defines.size() && entries.size() == defines.size();
+    for (size_t i = 0; i < entries.size() && isIdentity; i++)
+        isIdentity = entries[i].first == i && entries[i].second == i;
 
-    TaskData& taskData = g_TaskData.emplace_back();
-    taskData.source = configLine.source;
-    taskData.entryPoint = configLine.entryPoint;
-    taskData.profile = configLine.profile;
-    taskData.combinedDefines = combinedDefines;
-    taskData.outputFileWithoutExt = outputFileWithoutExt;
-    taskData.defines = configLine.defines;
-    taskData.optimizationLevel = optimizationLevel;
+    string ns = ToIdentifier(shaderName) + "_Permutations";
 
-    // Gather blobs
-    if (g_Options.IsBlob())
+    ostringstream out;
+    out << "// Generated by ShaderMake from \"" << EscapeString(g_Options.configFile.filename().string()) << "\", do not edit\n";
+    out << "#pragma once\n\n";
+    out << "#include <stdint.h>\n\n";
+    out << "namespace " << ns << "\n{\n";
+
+    for (const Domain& domain : domains)
     {
-        string blobName = PathToString(outputDir / shaderName);
-        vector<BlobEntry>& entries = g_ShaderBlobs[blobName];
+        vector<string> enumerators;
+        for (const string& value : domain.values)
+        {
+            string enumerator = IsIdentifier(value.c_str()) ? value : ToIdentifier("_" + value);
+            if (find(enumerators.begin(), enumerators.end(), enumerator) != enumerators.end())
+            {
+                Printf(YELLOW "WARNING: Can't generate typed permutations for '%s', values of '%s' map to the same enumerator '%s'!\n",
+                    shaderName.c_str(), domain.name.c_str(), enumerator.c_str());
+                return true;
+            }
+            enumerators.push_back(enumerator);
+        }
 
-        BlobEntry entry;
-        entry.permutationFileWithoutExt = outputFileWithoutExt;
-        entry.combinedDefines = combinedDefines;
-        entries.push_back(entry);
+        out << "\nenum class " << domain.identifier << "_Value : uint32_t\n{\n";
+        for (size_t i = 0; i < enumerators.size(); i++)
+            out << "    " << enumerators[i] << ", // " << domain.name << "=" << domain.values[i] << "\n";
+        out << "};\n";
     }
 
-    return true;
-}
+    out << "\nstruct Permutation\n{\n";
+    for (const Domain& domain : domains)
+        out << "    " << domain.identifier << "_Value " << domain.identifier << " = " << domain.identifier << "_Value(0);\n";
+    out << "};\n\n";
 
-bool ExpandPermutations(uint32_t lineIndex, const string& line, const fs::file_time_type& configTime)
-{
-    size_t opening = line.find('{');
-    if (opening == string::npos)
-        return ProcessConfigLine(lineIndex, line, configTime);
+    out << "constexpr uint32_t PermutationNum = " << defines.size() << ";\n";
+    out << "constexpr uint32_t InvalidIndex = UINT32_MAX;\n\n";
 
-    size_t closing = line.find('}', opening);
-    if (closing == string::npos)
+    out << "// Returns the index of the permutation in the blob, or \"InvalidIndex\" if it's not a part of the config\n";
+    out << "inline uint32_t GetIndex(const Permutation& permutation)\n{\n";
+    if (isIdentity)
     {
-        Printf(RED "%s(%u,0): ERROR: Missing '}'!\n", PathToString(g_Options.configFile).c_str(), lineIndex + 1);
-
-        return false;
+        out << "    uint32_t index = 0;\n";
+        for (const Domain& domain : domains)
+            out << "    index += uint32_t(permutation." << domain.identifier << ") * " << domain.stride << ";\n";
+        out << "\n    return index;\n";
+    }
+    else if (isDense)
+    {
+        vector<uint32_t> remap((size_t)combinationNum, UINT32_MAX);
+        for (const auto& [combination, index] : entries)
+            remap[(size_t)combination] = index;
+
+        out << "    static const uint32_t remap[] = {";
+        for (size_t i = 0; i < remap.size(); i++)
+            out << (i % 16 ? " " : "\n        ") << (remap[i] == UINT32_MAX ? string("InvalidIndex") : to_string(remap[i])) << ",";
+        out << "\n    };\n\n";
+
+        out << "    uint32_t combination = 0;\n";
+        for (const Domain& domain : domains)
+            out << "    combination += uint32_t(permutation." << domain.identifier << ") * " << domain.stride << ";\n";
+        out << "\n    return remap[combination];\n";
+    }
+    else
+    {
+        out << "    // Sorted by combination\n";
+        out << "    static const struct { uint64_t combination; uint32_t index; } entries[] = {\n";
+        for (const auto& [combination, index] : entries)
+            out << "        {" << combination << "ull, " << index << "},\n";
+        out << "    };\n\n";
+
+        out << "    uint64_t combination = 0;\n";
+        for (const Domain& domain : domains)
+            out << "    combination += uint64_t(permutation." << domain.identifier << ") * " << domain.stride << "ull;\n";
+        out << "\n";
+        out << "    uint32_t first = 0;\n";
+        out << "    uint32_t last = " << entries.size() << ";\n";
+        out << "    while (first < last)\n";
+        out << "    {\n";
+        out << "        uint32_t middle = first + (last - first) / 2;\n";
+        out << "        if (entries[middle].combination == combination)\n";
+        out << "            return entries[middle].index;\n";
+        out << "        else if (entries[middle].combination < combination)\n";
+        out << "            first = middle + 1;\n";
+        out << "        else\n";
+        out << "            last = middle;\n";
+        out << "    }\n\n";
+        out << "    return InvalidIndex;\n";
     }
+    out << "}\n\n";
 
-    size_t current = opening + 1;
-    while (true)
+    out << "// Returns the permutation key as stored in the blob, i.e. \"A=1 B=0\", or nullptr\n";
+    out << "inline const char* GetKey(const Permutation& permutation)\n{\n";
+    out << "    static const char* const keys[] = {\n";
+    for (const vector<string>& permutationDefines : defines)
     {
-        size_t comma = line.find(',', current);
-        if (comma == string::npos || comma > closing)
-            comma = closing;
+        string key;
+        for (const string& define : permutationDefines)
+            key += (key.empty() ? "" : " ") + define;
+        out << "        \"" << EscapeString(key) << "\",\n";
+    }
+    out << "    };\n\n";
+    out << "    uint32_t index = GetIndex(permutation);\n\n";
+    out << "    return index == InvalidIndex ? nullptr : keys[index];\n}\n\n";
 
-        string newConfig = line.substr(0, opening) + line.substr(current, comma - current) + line.substr(closing + 1);
-        if (!ExpandPermutations(lineIndex, newConfig, configTime))
-            return false;
+    out << "} // namespace " << ns << "\n";
 
-        current = comma + 1;
-        if (comma >= closing)
-            break;
+    if (!WriteTextFileIfChanged(permutations.headerFile, out.str()))
+    {
+        Printf(RED "ERROR: Can't write file '%s'!\n", PathToString(permutations.headerFile).c_str());
+        return false;
     }
 
     return true;
 }
 
-bool CreateBlob(const string& blobName, const vector<BlobEntry>& entries, bool useTextOutput)
+// Makefile syntax needs escaping of spaces, '#' and '$'
+string EscapeMakePath(const string& path)
 {
-    // Create output file
-    string outputFile = blobName;
-    outputFile += g_OutputExt;
-    if (useTextOutput)
-        outputFile += ".h";
-
-    DataOutputContext outputContext(outputFile.c_str(), useTextOutput);
-    if (!outputContext.stream)
+    string s;
+    for (char c : path)
     {
-        Printf(RED "ERROR: Can't open output file '%s'!\n", outputFile.c_str());
+        if (c == ' ' || c == '#')
+            s += '\\';
+        else if (c == '$')
+            s += '$';
 
-        return false;
+        s += c;
     }
 
-    if (useTextOutput)
-    {
-        string name = GetShaderName(blobName);
-        outputContext.WriteTextPreamble(name.c_str());
-    }
+    return s;
+}
 
-    ShaderMake::WriteFileCallback writeFileCallback = useTextOutput
-        ? &DataOutputContext::WriteDataAsTextCallback
-        : &DataOutputContext::WriteDataAsBinaryCallback;
+// Writes "targets: config sources includes" for build systems running ShaderMake, so they can skip it if nothing has changed
+bool CreateDepfile()
+{
+    set<string> dependencies;
+    dependencies.insert(fs::absolute(g_Options.configFile).lexically_normal().generic_string());
 
-    // Write "blob" header
-    if (!ShaderMake::WriteFileHeader(writeFileCallback, &outputContext))
+    // Includes scanned by ShaderMake or reported by the compiler
+    unordered_set<string> visited;
+    for (const Permutation& permutation : g_Permutations)
     {
-        Printf(RED "ERROR: Failed to write into output file '%s'!\n", outputFile.c_str());
+        auto found = g_Manifest.find(permutation.taskData.outputFileWithoutExt);
+        if (g_Options.compilerDeps && found != g_Manifest.end() && !found->second.dependencies.empty())
+        {
+            for (const string& dependency : found->second.dependencies)
+                dependencies.insert(fs::path(dependency).generic_string());
+
+            continue;
+        }
 
-        return false;
-    }
+        vector<string> stack = {permutation.sourceFile.string()};
+        while (!stack.empty())
+        {
+            string file = move(stack.back());
+            stack.pop_back();
 
-    bool success = true;
+            if (!visited.insert(file).second)
+                continue;
 
-    // Collect individual permutations
-    for (const BlobEntry& entry : entries)
-    {
-        // Open compiled permutation file
-        string file = entry.permutationFileWithoutExt + g_OutputExt;
+            auto node = g_DependencyGraph.find(file);
+            if (node == g_DependencyGraph.end() || !node->second.isOpened)
+                continue;
 
-        vector<uint8_t> fileData;
-        if (ReadBinaryFile(file.c_str(), fileData))
-        {
-            if (!ShaderMake::WritePermutation(writeFileCallback, &outputContext, entry.combinedDefines, fileData.data(), fileData.size()))
+            dependencies.insert(fs::absolute(file).lexically_normal().generic_string());
+
+            for (const ResolvedInclude& include : node->second.includes)
             {
-                Printf(RED "ERROR: Failed to write a shader permutation into '%s'!\n", outputFile.c_str());
-                success = false;
+                if (include.isFound)
+                    stack.push_back(include.file.string());
             }
         }
-        else
-            success = false;
-        
-        if (!success)
-            break;
     }
 
-    if (useTextOutput)
-        outputContext.WriteTextEpilog();
+    ostringstream text;
+    if (g_Options.depfileTarget)
+        text << EscapeMakePath(g_Options.depfileTarget);
+    else
+    {
+        const char* separator = "";
+        for (const string& output : g_OutputFiles)
+        {
+            text << separator << EscapeMakePath(output);
+            separator = " \\\n";
+        }
+    }
 
-    return success;
-}
+    text << ":";
+    for (const string& dependency : dependencies)
+        text << " \\\n  " << EscapeMakePath(dependency);
+    text << "\n";
 
-void RemoveIntermediateBlobFiles(const vector<BlobEntry>& entries)
-{
-    for (const BlobEntry& entry : entries)
+    string str = text.str();
+    DataOutputContext context(g_Options.depfile, false);
+    if (!context.stream || !context.WriteDataAsBinary(str.data(), str.size()))
     {
-        string file = entry.permutationFileWithoutExt + g_OutputExt;
-        fs::remove(file);
+        Printf(RED "ERROR: Can't write depfile '%s'!\n", g_Options.depfile);
+
+        return false;
     }
+
+    return true;
 }
 
-void SignalHandler(int32_t sig)
+bool IsRegistryUpToDate(const fs::file_time_type& configTime)
 {
-    UNUSED(sig);
+    StateFileReader reader(GetStateFile(".registry"), REGISTRY_STAMP_SIGNATURE, REGISTRY_STAMP_VERSION);
+    uint64_t optionsHash = reader.Read<uint64_t>();
+    if (!reader.IsValid() || optionsHash != GetRegistryOptionsHash())
+        return false;
 
-    g_Terminate = true;
+    fs::path registryFile = fs::path(g_Options.outputDir) / g_Options.registry;
 
-    Printf(RED "Aborting...\n");
-}
+    vector<fs::path> files = { fs::path(registryFile) += ".h", fs::path(registryFile) += ".cpp" };
+    for (uint32_t i = 0; i < g_Options.registryDataFiles; i++)
+        files.push_back(fs::path(registryFile) += "_data" + to_string(i) + ".cpp");
 
-int32_t main(int32_t argc, const char** argv)
-{
-    // Init timer
-    Timer_Init();
-    uint64_t start = Timer_GetTicks();
+    for (const fs::path& file : files)
+    {
+        error_code ec;
+        fs::file_time_type time = fs::last_write_time(file, ec);
+        if (ec || time < configTime)
+            return false;
+    }
 
-    // Set signal handler
-    signal(SIGINT, SignalHandler);
-#ifdef _WIN32
-    signal(SIGBREAK, SignalHandler);
-#endif
+    return true;
+}
 
-    // Parse command line
-    const char* self = argv[0];
-    if (!g_Options.Parse(argc, argv))
-        return 1;
+// Clears everything gathered by a build, except resident caches
+void ResetBuildState()
+{
+    g_Permutations.clear();
+    g_TaskData.clear();
+    g_ShaderBlobs.clear();
+    g_PreviousBlobs.clear();
+    g_RegistryEntries.clear();
+    g_ShaderPermutations.clear();
+    g_OutputFiles.clear();
+    g_HierarchicalUpdateTimes.clear();
+    g_HierarchicalHashes.clear();
+    g_MacroSets.clear();
+    g_UnknownMacros.clear();
+    g_PermutationMacros.clear();
+    g_UnseenMacros.clear();
+    g_GlobalOptionsHash = 0;
+    g_OutputDirectories.clear();
+    g_IsConditionEvaluationEnabled = true;
+
+    // A failed task terminates a build, but not watching. Without tasks the next build wouldn't reset the count, and a
+    // stale failure would skip the registry and the depfile
+    g_Terminate = g_IsInterrupted.load();
+    g_FailedTaskCount = 0;
+}
 
-    // Set envvar
-    char envBuf[1024];
-    if (!g_Options.useAPI)
+// Brings the resident include graph up to date with changed files
+void ApplyChanges(const vector<string>& modifiedFiles, bool isStructural, uint32_t threadsNum)
+{
+    // Created or deleted files can change resolution of any include. The dependency cache makes rescanning cheap
+    if (isStructural)
     {
-        #ifdef _WIN32 // workaround for Windows
-            snprintf(envBuf, sizeof(envBuf), "COMPILER=\"%s\"", g_Options.compiler);
-        #else
-            snprintf(envBuf, sizeof(envBuf), "COMPILER=%s", g_Options.compiler);
-        #endif
+        g_DependencyGraph.clear();
+        g_DirectoryListings.clear();
+        g_IncludeLookups.clear();
 
-        if (putenv(envBuf) != 0)
-            return 1;
+        return;
     }
 
-#ifdef _WIN32
-    // Setup a directory where to look for the compiler first
-    fs::path compilerPath = fs::path(g_Options.compiler).parent_path();
-    SetDllDirectoryA(compilerPath.string().c_str());
-    // This will still leave the launch folder as the first entry in the search path, so
-    // try to explicitly load the appropriate DLL from the correct path
-    if (g_Options.useAPI)
+    unordered_set<string> modified(modifiedFiles.begin(), modifiedFiles.end());
+    vector<fs::path> newFiles;
+
+    for (auto& [file, node] : g_DependencyGraph)
     {
-        char const* dllName = nullptr;
-        switch (g_Options.platform)
-        {
-        case DXIL:
-        case SPIRV:
-            dllName = "dxcompiler.dll";
-            break;
-        case DXBC:
-            dllName = "d3dcompiler_47.dll";
-            break;
-        default:
-            break;
-        }
-        if (dllName != nullptr)
+        if (modified.find(NormalizePath(file)) == modified.end())
+            continue;
+
+        node = DependencyNode();
+        ScanDependencyNode(file, node);
+
+        for (const ResolvedInclude& include : node.includes)
         {
-            fs::path dllPath = compilerPath / dllName;
-            if (LoadLibraryA(dllPath.string().c_str()) == NULL)
-            {
-                Printf(RED "ERROR: Failed to load compiler dll: \"%s\"!\n", dllPath.string().c_str());
-                return 1;
-            }
+            if (include.isFound && g_DependencyGraph.find(include.file.string()) == g_DependencyGraph.end())
+                newFiles.push_back(include.file);
         }
     }
-#endif
 
-    { // Gather shader permutations
-        fs::file_time_type configTime = fs::last_write_time(g_Options.configFile);
-        configTime = max(configTime, fs::last_write_time(self));
+    ScanDependencies(newFiles, threadsNum);
+}
+
+int32_t Build(const char* self, uint32_t threadsNum, uint64_t start)
+{
+    // Only the registry depends on config and executable times, permutations are checked by option fingerprints
+    fs::file_time_type configTime = fs::last_write_time(g_Options.configFile);
+    configTime = max(configTime, fs::last_write_time(self));
 
+    { // Gather shader permutations
         ifstream configStream(g_Options.configFile);
 
         string line;
@@ -2175,16 +6946,31 @@ int32_t main(int32_t argc, const char** argv)
             }
             else if (blocks.back())
             {
-                if (!ExpandPermutations(lineIndex, line, configTime))
+                if (!ExpandPermutations(lineIndex, line))
                     return 1;
             }
         }
     }
 
+    if (!CreateTasks(threadsNum))
+        return 1;
+
+    SaveDependencyCache();
+
+    // Generate typed permutation headers
+    for (const auto& [shaderName, permutations] : g_ShaderPermutations)
+    {
+        if (!CreatePermutationHeader(shaderName, permutations))
+            return 1;
+    }
+
     // Process tasks
-    if (!g_TaskData.empty())
+    bool hasTasks = !g_TaskData.empty();
+    if (hasTasks)
     {
         Printf(WHITE "Using compiler: %s\n", g_Options.compiler);
+        if (g_JobServer.IsActive())
+            Printf(WHITE "Using GNU make jobserver with %u worker(s)\n", threadsNum);
 
         g_OriginalTaskCount = (uint32_t)g_TaskData.size();
         g_ProcessedTaskCount = 0;
@@ -2193,27 +6979,55 @@ int32_t main(int32_t argc, const char** argv)
         // Retry limit for compilation task sub-process failures that can occur when threading
         g_TaskRetryCount = g_Options.retryCount;
 
-        uint32_t threadsNum = max(g_Options.serial ? 1 : thread::hardware_concurrency(), 1u);
+        SortTasksByDuration();
+
+        g_MemoryBudget.Init(uint64_t(g_Options.useAPI ? 0 : g_Options.memoryBudget) * 1024 * 1024);
+        if (g_MemoryBudget.IsActive())
+            EstimateTaskMemory(threadsNum);
+
+        // Compiler processes are managed by one event loop, if possible
+        bool isCompiled = false;
+#ifdef __linux__
+        if (!g_Options.useAPI)
+        {
+            g_TaskScheduler.Init(g_OriginalTaskCount, 1);
+            isCompiled = ExeCompileEventLoop(threadsNum);
+        }
+#endif
 
-        vector<thread> threads(threadsNum);
-        for (uint32_t i = 0; i < threadsNum; i++)
+        if (!isCompiled)
         {
-            if (!g_Options.useAPI)
-                threads[i] = thread(ExeCompile);
+            g_TaskScheduler.Init(g_OriginalTaskCount, threadsNum);
+
+            vector<thread> threads(threadsNum);
+            for (uint32_t i = 0; i < threadsNum; i++)
+            {
+                if (!g_Options.useAPI)
+                    threads[i] = thread(ExeCompile, i);
 #ifdef WIN32
-            else if (g_Options.platform == DXBC)
-                threads[i] = thread(FxcCompile);
-            else
-                threads[i] = thread(DxcCompile);
+                else if (g_Options.platform == DXBC)
+                    threads[i] = thread(FxcCompile, i);
+                else
+                    threads[i] = thread(DxcCompile, i);
 #endif
+            }
+
+            for (uint32_t i = 0; i < threadsNum; i++)
+                threads[i].join();
         }
 
-        for (uint32_t i = 0; i < threadsNum; i++)
-            threads[i].join();
+        SaveTaskHistory();
 
         // If a fatal error or a termination request happened, don't proceed to the blob building.
         if (g_Terminate)
+        {
+            for (const auto& [blobName, blobEntries] : g_ShaderBlobs)
+                RemoveBlobFromManifest(blobEntries);
+
+            SaveManifest();
+
             return 1;
+        }
 
         // Dump shader blobs
         for (const auto& [blobName, blobEntries] : g_ShaderBlobs)
@@ -2241,30 +7055,48 @@ int32_t main(int32_t argc, const char** argv)
 
             if (invalidEntry)
             {
+                RemoveBlobFromManifest(blobEntries);
+
                 if (g_Options.continueOnError)
                     continue;
 
+                SaveManifest();
+
                 return 1;
             }
 
             if (g_Options.binaryBlob)
             {
                 bool result = CreateBlob(blobName, blobEntries, false);
+                if (result && g_Options.assembly)
+                    result = WriteAssembly(blobName + g_OutputExt, GetShaderName(blobName));
+                if (!result)
+                    RemoveBlobFromManifest(blobEntries);
                 if (!result && !g_Options.continueOnError)
+                {
+                    SaveManifest();
                     return 1;
+                }
             }
 
             if (g_Options.headerBlob)
             {
                 bool result = CreateBlob(blobName, blobEntries, true);
+                if (!result)
+                    RemoveBlobFromManifest(blobEntries);
                 if (!result && !g_Options.continueOnError)
+                {
+                    SaveManifest();
                     return 1;
+                }
             }
 
             if (!g_Options.binary)
                 RemoveIntermediateBlobFiles(blobEntries);
         }
 
+        SaveManifest();
+
         // Report failed tasks
         if (g_FailedTaskCount)
             Printf(YELLOW "WARNING: %u task(s) failed to complete!\n", g_FailedTaskCount.load());
@@ -2272,10 +7104,182 @@ int32_t main(int32_t argc, const char** argv)
             Printf(WHITE "%d task(s) completed successfully.\n", g_OriginalTaskCount);
 
         uint64_t end = Timer_GetTicks();
-        Printf(WHITE "Elapsed time %.2f ms\n", Timer_ConvertTicksToMilliseconds(end - start));
+        Printf(WHITE "Elapsed time %.2f ms (%u worker(s), %s)\n", Timer_ConvertTicksToMilliseconds(end - start), threadsNum, g_ThreadsNumOrigin);
+
+        if (g_MemoryBudget.IsActive())
+        {
+            Printf(WHITE "Memory budget %u MB: %u compilation(s) waited for memory for %.2f ms in total\n",
+                g_Options.memoryBudget, g_MemoryBudget.GetStallNum(), Timer_ConvertTicksToMilliseconds(g_MemoryBudget.GetStallTicks()));
+        }
     }
     else
+    {
         Printf(WHITE "All %s shaders are up to date.\n", g_Options.platformName);
 
+        SaveManifest();
+    }
+
+    // Generate the registry
+    if (g_Options.registry && !g_Terminate && !g_FailedTaskCount && (hasTasks || !IsRegistryUpToDate(configTime)))
+    {
+        if (!CreateRegistry())
+            return 1;
+
+        Printf(WHITE "Registry '%s' contains %u permutation(s).\n", g_Options.registry, (uint32_t)g_RegistryEntries.size());
+    }
+
+    // Generate the depfile
+    if (g_Options.depfile && !g_Terminate && !g_FailedTaskCount && !CreateDepfile())
+        return 1;
+
     return (g_Terminate || g_FailedTaskCount) ? 1 : 0;
 }
+
+// Keeps permutations, which depend on changed files, up to date. The include graph and caches stay in memory
+int32_t Watch(const char* self, uint32_t threadsNum)
+{
+    Watcher watcher;
+    if (!watcher.IsValid())
+    {
+        Printf(RED "ERROR: Can't watch for file changes!\n");
+
+        return 1;
+    }
+
+    while (true)
+    {
+        watcher.Reset();
+        watcher.Watch(g_Options.configFile);
+
+        for (const auto& [file, node] : g_DependencyGraph)
+        {
+            watcher.Watch(file);
+
+            for (const ResolvedInclude& include : node.includes)
+                watcher.WatchIncludeName(include.file.string());
+        }
+
+        for (const Permutation& permutation : g_Permutations)
+        {
+            auto found = g_Manifest.find(permutation.taskData.outputFileWithoutExt);
+            if (found == g_Manifest.end())
+                continue;
+
+            for (const string& dependency : found->second.dependencies)
+                watcher.Watch(dependency);
+        }
+
+        Printf(WHITE "Watching for changes, press Ctrl+C to stop...\n");
+
+        vector<string> modifiedFiles;
+        bool isStructural;
+        if (!watcher.Wait(modifiedFiles, isStructural))
+            return 0;
+
+        ApplyChanges(modifiedFiles, isStructural, threadsNum);
+        ResetBuildState();
+
+        Build(self, threadsNum, Timer_GetTicks());
+    }
+}
+
+void SignalHandler(int32_t sig)
+{
+    UNUSED(sig);
+
+    g_Terminate = true;
+    g_IsInterrupted = true;
+
+    Printf(RED "Aborting...\n");
+}
+
+int32_t main(int32_t argc, const char** argv)
+{
+    // Init timer
+    Timer_Init();
+    uint64_t start = Timer_GetTicks();
+
+    // Set signal handler
+    signal(SIGINT, SignalHandler);
+#ifdef _WIN32
+    signal(SIGBREAK, SignalHandler);
+#endif
+
+    // Parse command line
+    const char* self = argv[0];
+    if (!g_Options.Parse(argc, argv))
+        return 1;
+
+    // Set envvar, the compiler is started through the shell on Windows
+#ifdef _WIN32
+    char envBuf[1024];
+    if (!g_Options.useAPI)
+    {
+        snprintf(envBuf, sizeof(envBuf), "COMPILER=\"%s\"", g_Options.compiler); // workaround for Windows
+
+        if (putenv(envBuf) != 0)
+            return 1;
+    }
+#endif
+
+    if (!g_Options.useAPI)
+        InitSharedCompilerArguments();
+
+#ifdef _WIN32
+    // Setup a directory where to look for the compiler first
+    fs::path compilerPath = fs::path(g_Options.compiler).parent_path();
+    SetDllDirectoryA(compilerPath.string().c_str());
+    // This will still leave the launch folder as the first entry in the search path, so
+    // try to explicitly load the appropriate DLL from the correct path
+    if (g_Options.useAPI)
+    {
+        char const* dllName = nullptr;
+        switch (g_Options.platform)
+        {
+        case DXIL:
+        case SPIRV:
+            dllName = "dxcompiler.dll";
+            break;
+        case DXBC:
+            dllName = "d3dcompiler_47.dll";
+            break;
+        default:
+            break;
+        }
+        if (dllName != nullptr)
+        {
+            fs::path dllPath = compilerPath / dllName;
+            if (LoadLibraryA(dllPath.string().c_str()) == NULL)
+            {
+                Printf(RED "ERROR: Failed to load compiler dll: \"%s\"!\n", dllPath.string().c_str());
+                return 1;
+            }
+        }
+    }
+#endif
+
+    uint32_t threadsNum = 1;
+    if (g_Options.serial)
+        g_ThreadsNumOrigin = "--serial";
+    else if (g_Options.jobs)
+    {
+        threadsNum = (uint32_t)g_Options.jobs;
+        g_ThreadsNumOrigin = "--jobs";
+    }
+    else
+        threadsNum = GetAvailableCpuNum(g_ThreadsNumOrigin);
+
+    // Share the parallelism budget of the parent build system. API compilation is in-process
+    if (!g_Options.useAPI)
+        g_JobServer.Init();
+
+    LoadDependencyCache();
+    LoadManifest();
+    LoadTaskHistory();
+
+    int32_t result = Build(self, threadsNum, start);
+    if (!g_Options.watch || g_IsInterrupted)
+        return result;
+
+    return Watch(self, threadsNum);
+}